@@ -8,7 +8,6 @@ URL:            https://github.com/longlodwyorku/balancer
 Source0:        %URL/archive/refs/tags/v%{version}.tar.gz
 
 BuildRequires:  g++ 
-BuildRequires:  libmonitor-devel
 BuildRequires:  make
 
 %description
@@ -24,7 +23,6 @@ The %name-proxy package contains the reverse proxy / load balancer server.
 %package monitor
 Summary:        monitoring service
 Requires:       balancer = %{version}-%{release}
-Requires:       libmonitor
 
 %description monitor
 The %name-monitor package contains the monitoring service.
@@ -0,0 +1,137 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <netinet/in.h>
+#include <vector>
+
+struct backend {
+  // bounds how much of the round robin schedule a single backend can take
+  static constexpr float MAX_CAPACITY = 16;
+
+  sockaddr_in address;
+  // milliseconds since the epoch, as sent by the monitor
+  uint64_t timestamp;
+  float cpu;
+  float mem;
+  uint32_t id;
+  // mirrored from backend_health by the control thread
+  bool ejected = false;
+  // set by a reload, keeps the backend's connections but takes no new ones
+  bool draining = false;
+  // only sent by v2 monitors, v1 ones leave the defaults
+  uint32_t sequence = 0;
+  float capacity = 1;
+  float load_average = 0;
+  uint32_t run_queue = 0;
+  uint64_t rx_rate = 0;
+  uint64_t tx_rate = 0;
+  uint32_t connections = 0;
+  float cpu_pressure = 0;
+  float memory_pressure = 0;
+  float io_pressure = 0;
+
+  // share of traffic the reported load leaves room for, 0 when saturated
+  float weight() const {
+    float load = cpu * mem;
+    float scale = capacity < MAX_CAPACITY ? capacity : MAX_CAPACITY;
+    return load < 1 && scale > 0 ? (1 - load) * scale : 0;
+  }
+};
+
+// how long a report keeps a backend valid
+static constexpr uint64_t TELEMETRY_TTL_MS = 5000;
+
+bool valid_timestamp(uint64_t timestamp);
+
+// maglev lookup table over a set of backends. every backend fills the table
+// along its own permutation, derived from its address only, so adding or
+// dropping one backend moves few entries of the others.
+struct maglev_table {
+  static constexpr uint32_t SIZE = 65537;
+  // backend indexes the table was built from
+  std::vector<uint32_t> members;
+  std::vector<uint32_t> entries;
+
+  maglev_table(const std::vector<backend> &backends, const std::vector<uint32_t> &members);
+  uint32_t lookup(uint32_t hash) const {
+    return entries[hash % SIZE];
+  }
+};
+
+// immutable once published, workers read it without any synchronisation
+struct backend_snapshot {
+  // integer weight units of a backend in the round robin schedule
+  static constexpr uint32_t WRR_UNITS = 16;
+  // whether prepare() keeps a maglev table for consistent hashing
+  static inline bool consistent_hash = false;
+
+  std::vector<backend> backends;
+
+  // derived by prepare() from backends when the snapshot is published
+  uint32_t max_id = 0;
+  // indexes of the backends that were usable and not ejected at publish time
+  std::vector<uint32_t> valid;
+  // running sum of the weights of valid
+  std::vector<float> prefix;
+  // backend indexes spread in proportion to their weights
+  std::vector<uint32_t> schedule;
+  // shared between snapshots as long as valid stays the same
+  std::shared_ptr<const maglev_table> maglev;
+
+  void prepare();
+  // the backend with the id, nullptr once a reload removed it
+  backend *find(uint32_t id) {
+    for (backend &server : backends) {
+      if (server.id == id) {
+        return &server;
+      }
+    }
+    return nullptr;
+  }
+  // a backend counted as valid went silent since the snapshot was prepared
+  bool expired() const;
+};
+
+// publishes backend snapshots to the workers with quiescent state based
+// reclamation. a worker announces the epoch it has seen whenever it holds no
+// snapshot pointer (between events) and goes offline while blocked, a
+// replaced snapshot is freed once every online worker has announced a newer
+// epoch. readers never write a cache line shared with another thread.
+class backend_registry {
+  struct alignas(64) reader_state {
+    std::atomic<uint64_t> seen{0};
+  };
+  struct retired_snapshot {
+    uint64_t epoch;
+    const backend_snapshot *snapshot;
+  };
+
+  alignas(64) std::atomic<const backend_snapshot*> current;
+  std::atomic<uint64_t> epoch{1};
+  std::unique_ptr<reader_state[]> readers;
+  size_t readers_count;
+  std::vector<retired_snapshot> retired;
+
+  void reclaim();
+public:
+  backend_registry(size_t readers_count, backend_snapshot *initial);
+  backend_registry(const backend_registry&) = delete;
+  backend_registry& operator=(const backend_registry&) = delete;
+  ~backend_registry();
+
+  // reader side, each worker uses its own index
+  const backend_snapshot *get() const {
+    return current.load(std::memory_order_acquire);
+  }
+  void quiescent(size_t reader) {
+    readers[reader].seen.store(epoch.load(std::memory_order_acquire));
+  }
+  void offline(size_t reader) {
+    readers[reader].seen.store(0, std::memory_order_release);
+  }
+
+  // writer side, only ever called from the control thread
+  void publish(backend_snapshot *next);
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include "backends.hpp"
+#include "health.hpp"
+#include "metrics.hpp"
+#include <cstdint>
+#include <vector>
+
+// xorshift64*, one per worker so picking a backend never touches shared state
+struct fast_rng {
+  uint64_t state;
+
+  explicit fast_rng(uint64_t seed);
+  uint64_t next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dULL;
+  }
+  // uniform in [0, n)
+  uint32_t below(uint32_t n) {
+    return (uint32_t) (((next() >> 32) * n) >> 32);
+  }
+  // uniform in [0, 1)
+  float uniform() {
+    return (next() >> 40) * (1.0f / (1 << 24));
+  }
+};
+
+enum class strategy : uint8_t {
+  telemetry,
+  p2c,
+  least_conn,
+  wrr,
+  maglev,
+  peak_ewma,
+};
+
+int parse_strategy(const char *name, strategy &out);
+
+// picks backends for the connections of one worker. connection counts are
+// kept per worker and indexed by backend id, with evenly loaded workers each
+// one's share stands in for the global count without any shared writes.
+class balancer {
+  // what this worker saw of a backend's connects, both averages fade with
+  // decay_ms between samples and while no samples come in
+  struct connect_signal {
+    // peak ewma, a slower connect raises it at once, faster ones lower it gradually
+    double latency_us = 0;
+    // ewma of failed connects, 1 for a failure and 0 for a success
+    double error_rate = 0;
+    // monotonic microseconds of the last sample, 0 before the first one
+    uint64_t updated_us = 0;
+  };
+
+  fast_rng rng;
+  std::vector<uint32_t> active;
+  std::vector<connect_signal> signals;
+  // the owning worker's, mirrors active and connect outcomes
+  worker_metrics *stats;
+  uint64_t tick;
+
+  const backend *telemetry(const backend_snapshot &snapshot);
+  const backend *p2c(const backend_snapshot &snapshot);
+  const backend *least_conn(const backend_snapshot &snapshot);
+  const backend *wrr(const backend_snapshot &snapshot);
+  const backend *maglev(const backend_snapshot &snapshot, const sockaddr_in &client);
+  const backend *peak_ewma(const backend_snapshot &snapshot);
+  double cost(const backend &server, uint64_t now_us) const;
+  void observe(uint32_t id, uint64_t latency_us, bool failed);
+  const backend *any_valid(const backend_snapshot &snapshot, uint32_t avoid);
+  bool usable(const backend &server, uint32_t avoid) const;
+public:
+  static inline strategy mode = strategy::telemetry;
+  // shared by all workers, null when connect outcomes are not tracked
+  static inline backend_health *health = nullptr;
+  // time constant of the peak-ewma connect latency and error rate
+  static inline uint64_t decay_ms = 10000;
+  // how much a backend that fails every connect costs over a healthy one
+  static constexpr double ERROR_PENALTY = 10;
+
+  balancer(uint64_t seed, worker_metrics *stats);
+  // client is only looked at by maglev, which keeps a client address on the
+  // same backend while the set of valid backends does not change. avoid is
+  // the id of a backend that just failed the connection, it is never picked.
+  const backend *get_server(const backend_snapshot &snapshot, const sockaddr_in &client, uint32_t avoid = UINT32_MAX);
+  void on_open(uint32_t id);
+  void on_close(uint32_t id);
+  void on_connected(uint32_t id, uint64_t latency_us);
+  void on_failed(uint32_t id);
+};
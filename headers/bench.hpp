@@ -0,0 +1,25 @@
+#pragma once
+#include "endian_convert.hpp"
+#include <cstdint>
+#include <cstring>
+
+// what balancer-loadgen asks of balancer-echo: a header followed by
+// request_size bytes, answered with response_size bytes once all of them
+// arrived. sending and receiving the same size is an echo, either one a
+// single byte is an upload or a download.
+struct bench_request {
+  static constexpr size_t SIZE = 2 * sizeof(uint32_t);
+
+  uint32_t request_size;
+  uint32_t response_size;
+
+  void encode(char *buf) const {
+    uint32_t sizes[2] = {endian_convert::hton(request_size), endian_convert::hton(response_size)};
+    memcpy(buf, sizes, SIZE);
+  }
+  static bench_request decode(const char *buf) {
+    uint32_t sizes[2];
+    memcpy(sizes, buf, SIZE);
+    return {endian_convert::ntoh(sizes[0]), endian_convert::ntoh(sizes[1])};
+  }
+};
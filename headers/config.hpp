@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+
+struct backend_config {
+  sockaddr_in address;
+  // where telemetry from its monitor arrives, unused with one telemetry socket
+  sockaddr_in monitor;
+  // keeps its connections and telemetry but gets no new connections
+  bool drain = false;
+};
+
+// what the positional arguments or a config file describe. a config file has
+// one setting per line, blank lines and lines starting with # are skipped:
+//
+//   max-connections <number>
+//   listen <address> <port>
+//   backend <address> <port> <monitor address> <monitor port> [drain]
+//   <long option> [<value>...]
+//
+// any other line is a long option of the command line without its dashes,
+// for example "strategy p2c" or "reuseport". a file starting with a bare
+// number has the older layout, the positional arguments alone split over any
+// number of lines.
+struct proxy_config {
+  int max_connections = 0;
+  std::string listen_address;
+  uint16_t listen_port = 0;
+  std::vector<backend_config> backends;
+  // "--<option>" followed by its values, in file order
+  std::vector<std::string> options;
+
+  // -1 with the reason on stderr
+  int load(const char *path);
+  int load(int argc, char *argv[]);
+};
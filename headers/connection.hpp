@@ -1,39 +1,208 @@
 #pragma once
 #include <cstddef>
 #include <sys/types.h>
+#include <memory>
 #include <vector>
-#include <unordered_map>
 #include <cstdint>
+#include <netinet/in.h>
 
-struct connection {
+// fixed size buffers of one worker for channels relayed through userspace.
+// they come from chunks that are never freed and go back to a free list, so
+// moving a channel between the pipe and a buffer allocates nothing.
+class buffer_slab {
+  static constexpr size_t CHUNK_BUFFERS = 64;
+  std::vector<std::unique_ptr<char[]>> chunks;
+  std::vector<char*> free_buffers;
+  size_t allocated = 0;
+public:
+  static constexpr size_t BUFFER_SIZE = 16384;
+  // buffers one worker hands out at most, channels beyond it keep splicing
+  static inline size_t max_buffers = 2048;
+
+  // null once max_buffers are in use
+  char *acquire();
+  void release(char *buffer);
+};
+
+// one direction of a relayed connection: bytes are spliced from the source
+// socket into the pipe and from the pipe into the destination socket. small
+// reads cost less with recv and send through a buffer than with two splices,
+// so a channel whose reads stay small moves to a buffer while it is empty.
+struct channel {
+  static constexpr size_t MIN_CHUNK = 4096;
+  // capacity requested for every pipe, 0 keeps the kernel default
+  static inline size_t pipe_size = 0;
+  // average read size under which a channel moves to a buffer, 0 never.
+  // it moves back to the pipe once its reads average 4 times as much.
+  static inline size_t buffered_below = 1024;
+  static constexpr size_t SPLICE_FACTOR = 4;
+
+  // bytes in the pipe, or in the buffer while the channel has one
   ssize_t bytes_in_pipe;
+  size_t capacity;
+  size_t chunk;
   int pipes[2];
+  bool eof;
+  bool shut;
+  bool in_flight;
+  // where the bytes not written yet start in the buffer
+  uint32_t buffer_offset;
+  // of recent reads, 0 before the first one
+  uint32_t average_read;
+  char *buffer = nullptr;
+
+  int open();
+  void close() const;
+  int write(int fd);
+  int read(int fd);
+  size_t read_size() const;
+  void on_read(size_t s);
+  bool has_room() const;
+  // only while nothing is buffered, so bytes keep their order
+  void pick_relay(buffer_slab &slab);
+  void release_buffer(buffer_slab &slab);
+};
+
+size_t pipe_size_for_budget(size_t budget, int max_connections);
+
+struct connection;
+
+enum class endpoint_state : uint8_t {
+  closed,
+  listen,
+  preread_client,
+  connecting_server,
+  transfer,
+  pool_connecting,
+  pool_idle,
+  timer,
+  wake,
+};
+
+// what an fd registered in a worker's epoll stands for, the event's data.ptr
+// points straight at it.
+struct endpoint {
+  connection *conn;
+  endpoint_state state;
+};
+
+// names a connection slot as it was when the handle was taken; once the slot
+// is reused the generation no longer matches.
+struct connection_handle {
+  uint32_t index;
+  uint32_t generation;
+};
+
+// fields touched on every event come first and fill the first cache lines,
+// bookkeeping that is only read on setup and teardown sits in its own line.
+struct alignas(64) connection {
   int server;
   int client;
   uint32_t server_event;
   uint32_t client_event;
-  int des;
+  endpoint client_end;
+  endpoint server_end;
+  bool server_connected;
+  bool closing;
+  uint8_t pending;
+  // timer wheel tick of the last event seen in transfer
+  uint64_t last_active;
+  channel upstream;
+  channel downstream;
+
+  struct alignas(64) cold_fields {
+    uint32_t index;
+    uint32_t generation;
+    // id of the backend the server socket connects to
+    uint32_t backend;
+    // set once the kernel relays the connection through the sockmap
+    bool in_kernel;
+    // queued to look at its end of stream again after the next batch
+    bool draining;
+    uint8_t join_attempts;
+    // backends tried for this connection so far
+    uint8_t connect_attempts;
+    // client bytes left the upstream pipe in a fast open SYN, another
+    // backend could not get them
+    bool sent_in_syn;
+    // socket cookies and byte counts of client and server when they joined
+    uint64_t cookies[2];
+    uint64_t received_base[2];
+    uint64_t queued_base[2];
+    // bytes both sockets received as of the last timer check, the kernel
+    // relay moves them without any event
+    uint64_t kernel_received;
+    // expiry of the wheel entry that counts, later ones are superseded. 0
+    // when none is scheduled
+    uint64_t timer_due;
+    // monotonic_us() when the connect to the current backend started
+    uint64_t connect_started;
+    // what an io_uring connect reads, the kernel only copies it at submission
+    // and the snapshot the backend came from can be gone by then
+    sockaddr_in connect_address;
+  } cold;
 
+  // server_fd is an already connected backend socket, or -1 to open one
+  int open(int client_fd, int server_fd);
   void clean_up(int ep) const;
-  int write(int fd);
-  int read(int fd, size_t buffer_size);
-  int get_peer(int fd) const;
-  uint32_t *get_event(int fd);
+  bool finished() const;
+  int get_fd(const endpoint *end) const;
+  uint32_t *get_event(const endpoint *end);
+  connection_handle handle() const;
 };
 
+// connections live in fixed size chunks that are never moved or freed, so
+// slot addresses stay valid for the lifetime of the manager. fds index a
+// dense table straight to their connection. slots of removed connections are
+// only reused after reclaim(), so events already returned by epoll_wait
+// never point at a different connection.
 class connections_manager {
-  std::vector<size_t> empty_slots;
-  std::vector<connection> connections;
-  std::unordered_map<int, size_t> fd_to_index;
+  static constexpr size_t CHUNK_SLOTS = 1024;
+  std::vector<std::unique_ptr<connection[]>> chunks;
+  std::vector<uint32_t> empty_slots;
+  std::vector<uint32_t> released_slots;
+  std::vector<connection*> by_fd;
+  size_t live = 0;
   const int ep;
+  buffer_slab slab;
+
+  connection *slot(uint32_t index) const {
+    return &chunks[index / CHUNK_SLOTS][index % CHUNK_SLOTS];
+  }
+  void unlink(connection &conn);
 public:
   connections_manager(int& ep);
   ~connections_manager();
-  void add(const connection& conn);
+  connection* add(const connection& conn);
   void remove(int fd);
-  connection* get(int fd);
+  void detach(int fd);
+  void replace_server(connection &conn, int server_fd);
+  void reclaim();
+  size_t size() const {
+    return live;
+  }
+  // connections give their buffers back when they are removed
+  buffer_slab &buffers() {
+    return slab;
+  }
+  connection* get(int fd) const {
+    return (size_t) fd < by_fd.size() ? by_fd[fd] : nullptr;
+  }
+  connection* get(connection_handle h) const {
+    if (h.index >= chunks.size() * CHUNK_SLOTS) {
+      return nullptr;
+    }
+    connection *conn = slot(h.index);
+    return conn->cold.generation == h.generation ? conn : nullptr;
+  }
 };
 
 int epoll_add(int ep, int fd, uint32_t event);
+int epoll_add(int ep, int fd, uint32_t event, endpoint *end);
 int epoll_del(int ep, int fd);
 int epoll_mod(int ep, int fd, uint32_t event);
+// both directions are relayed as they arrive, Nagle would hold a partial last
+// segment back until the peer's delayed ack
+int set_nodelay(int fd);
+// a nonblocking tcp socket with Nagle off, for connecting to a backend
+int backend_socket();
@@ -0,0 +1,26 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+// live connection count sharded per worker. each shard sits in its own cache
+// line and is only ever written by the worker that owns it, the global view
+// used for admission is the sum over all shards.
+class connection_counters {
+  struct alignas(64) shard {
+    std::atomic<int> connections{0};
+  };
+  std::unique_ptr<shard[]> shards;
+  size_t count;
+public:
+  connection_counters(size_t count);
+
+  void add(size_t worker, int delta) {
+    std::atomic<int> &c = shards[worker].connections;
+    c.store(c.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+  }
+  int local(size_t worker) const {
+    return shards[worker].connections.load(std::memory_order_relaxed);
+  }
+  int total() const;
+};
@@ -0,0 +1,24 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+
+// passing the listen sockets from a running proxy to its replacement. the
+// running proxy listens on a unix socket at a path, the new one connects to
+// it at startup and gets every listen socket in a single SCM_RIGHTS message.
+// both accept from the same queues until the new one confirms it is ready,
+// only then the old one stops accepting and drains, so no connection waiting
+// in a queue is lost and none reaches a proxy without backends yet.
+
+// the most sockets one message carries, the kernel's SCM_MAX_FD
+static constexpr size_t MAX_HANDOFF_FDS = 253;
+
+// 1 with the sockets of the proxy listening at path and the connection to
+// confirm on, 0 when none listens there, -1 when one does and the handoff failed
+int receive_listeners(const char *path, std::vector<int> &fds, int &peer);
+// closes peer
+int confirm_handoff(int peer);
+int send_listeners(int fd, const std::vector<int> &fds);
+// false when the new proxy went away without confirming
+bool handoff_confirmed(int peer);
+// replaces whatever is at path, the previous proxy does not unlink it
+int init_handoff_listen(const char *path);
@@ -0,0 +1,80 @@
+#pragma once
+#include "backends.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// connect outcomes per backend id, reported by every worker and read on each
+// pick. max_failures consecutive failed connects eject a backend for
+// eject_ms, failing active probes keep it out until a probe succeeds again.
+// the control thread mirrors the state into the published snapshots.
+class backend_health {
+  struct alignas(64) backend_state {
+    std::atomic<uint32_t> failures{0};
+    // steady clock milliseconds, 0 when not ejected
+    std::atomic<uint64_t> ejected_until{0};
+    std::atomic<bool> probe_down{false};
+    // only touched by the control thread
+    uint32_t probe_failures = 0;
+  };
+  std::unique_ptr<backend_state[]> states;
+  size_t count;
+  // written on every ejection to wake the control thread
+  int event_fd;
+public:
+  // consecutive failed connects that eject a backend, 0 never ejects
+  static inline uint32_t max_failures = 3;
+  static inline uint64_t eject_ms = 10000;
+  // consecutive failed probes that take a backend down
+  static constexpr uint32_t PROBE_FAILURES = 2;
+
+  backend_health(size_t count);
+  backend_health(const backend_health&) = delete;
+  backend_health& operator=(const backend_health&) = delete;
+  ~backend_health();
+
+  int fd() const {
+    return event_fd;
+  }
+  bool available(uint32_t id) const;
+  void on_connected(uint32_t id);
+  void on_failed(uint32_t id);
+  void on_probe(uint32_t id, bool ok);
+  // clears the eventfd after a wake up
+  void drain() const;
+  // copies the current state into the ejected flags, true when one changed
+  bool apply(backend_snapshot &snapshot) const;
+};
+
+// active tcp probes of every backend, run on the control thread. a probe is a
+// plain connect, one that has not finished by the next round counts as failed.
+class health_prober {
+  struct probe {
+    int fd;
+    uint32_t id;
+  };
+  backend_health &health;
+  std::vector<probe> probes;
+  uint64_t last_round = 0;
+  // the probes' own epoll, itself registered in the control thread's one
+  int ep;
+
+  void finish(size_t k, bool ok);
+public:
+  // milliseconds between rounds, 0 disables probing
+  static inline uint64_t interval_ms = 0;
+
+  health_prober(backend_health &health);
+  health_prober(const health_prober&) = delete;
+  health_prober& operator=(const health_prober&) = delete;
+  ~health_prober();
+
+  int fd() const {
+    return ep;
+  }
+  void handle_events();
+  // starts a round when one is due
+  void maintain(const backend_snapshot &snapshot);
+};
@@ -0,0 +1,61 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <string>
+
+// exponentially weighted moving average of samples taken at uneven intervals,
+// a sample counts less the longer ago it was taken, with time constant tau_ms
+struct ewma {
+  double value = 0;
+  bool primed = false;
+
+  void add(double sample, double elapsed_ms, double tau_ms) {
+    if (!primed || tau_ms <= 0) {
+      value = sample;
+      primed = true;
+      return;
+    }
+    value += (1 - std::exp(-elapsed_ms / tau_ms)) * (sample - value);
+  }
+};
+
+// load between two calls of load_sampler::sample, all fractions of 0..1
+struct load_sample {
+  // busy share of the cpu time the cgroup may use, raised to the host's busy
+  // share and the time the cgroup spent throttled
+  float cpu = 0;
+  // memory in use against the cgroup limit, or against the host's memory
+  float mem = 0;
+  // share of time some tasks were stalled waiting for the resource
+  float cpu_pressure = 0;
+  float memory_pressure = 0;
+  float io_pressure = 0;
+};
+
+// reads /proc/stat, /proc/meminfo, the pressure stall files and the files of
+// the cgroup v2 the monitor runs in. a backend in a container is judged by
+// its limits rather than by the whole host's load.
+class load_sampler {
+  // directory of the cgroup, empty without cgroup v2
+  std::string cgroup;
+  uint64_t last_us = 0;
+  uint64_t host_busy = 0;
+  uint64_t host_total = 0;
+  uint64_t cgroup_usage_us = 0;
+  uint64_t cgroup_throttled_us = 0;
+  // "some" stall totals of cpu, memory and io in microseconds
+  uint64_t stalls[3] = {};
+
+  void read_counters(uint64_t &busy, uint64_t &total, uint64_t &usage_us, uint64_t &throttled_us, uint64_t (&stall)[3]) const;
+  // cpus the cgroup may use, the online cpus without a quota
+  double cpu_limit() const;
+  float memory_usage() const;
+public:
+  // finds the cgroup and takes the first counters, -1 without /proc/stat
+  int init();
+  const std::string &cgroup_path() const {
+    return cgroup;
+  }
+  // load since the previous call, or since init
+  load_sample sample();
+};
@@ -0,0 +1,103 @@
+#pragma once
+#include "backends.hpp"
+#include "counters.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// a value written by a single thread and read by any other, so updating it
+// is a plain load and store instead of a locked read-modify-write
+template <typename T>
+struct single_writer {
+  std::atomic<T> value{0};
+
+  void add(T delta) {
+    value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+  }
+  T get() const {
+    return value.load(std::memory_order_relaxed);
+  }
+};
+using metric_counter = single_writer<uint64_t>;
+using metric_gauge = single_writer<int64_t>;
+
+// log-linear histogram in the manner of HdrHistogram: every power of two is
+// split into SUB_BUCKETS linear buckets, the relative error stays below
+// 1 / SUB_BUCKETS at any magnitude. values are microseconds.
+class latency_histogram {
+public:
+  static constexpr uint32_t SUB_BITS = 3;
+  static constexpr uint32_t SUB_BUCKETS = 1 << SUB_BITS;
+  // values from 2^MAX_BITS on, a bit over an hour, share the last bucket
+  static constexpr uint32_t MAX_BITS = 32;
+  static constexpr uint32_t BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+private:
+  metric_counter counts[BUCKETS];
+  metric_counter total;
+public:
+  static uint32_t bucket(uint64_t value);
+  // largest value that falls into a bucket
+  static uint64_t upper_bound(uint32_t bucket);
+
+  void record(uint64_t value) {
+    counts[bucket(value)].add(1);
+    total.add(value);
+  }
+  uint64_t count(uint32_t bucket) const {
+    return counts[bucket].get();
+  }
+  uint64_t sum() const {
+    return total.get();
+  }
+};
+
+inline uint64_t monotonic_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// the metrics of one worker, only written by it and cache line aligned so
+// workers never share a line
+struct alignas(64) worker_metrics {
+  // bytes and splice calls of one relay direction
+  struct direction {
+    metric_counter bytes;
+    metric_counter reads;
+    metric_counter writes;
+    // reads that found the source drained
+    metric_counter eagain;
+  };
+
+  metric_counter accepts;
+  metric_counter connects;
+  metric_counter connect_failures;
+  metric_counter timeouts;
+  direction upstream;
+  direction downstream;
+  latency_histogram connect_latency;
+  // open connections of this worker by backend id
+  std::unique_ptr<metric_gauge[]> backend_connections;
+  uint32_t backends = 0;
+
+  void add_backend_connection(uint32_t id, int64_t delta) {
+    if (id < backends) {
+      backend_connections[id].add(delta);
+    }
+  }
+};
+
+// per worker metrics, summed up only when they are rendered
+class metrics_registry {
+  std::unique_ptr<worker_metrics[]> shards;
+  size_t count;
+public:
+  metrics_registry(size_t workers, uint32_t backends);
+
+  worker_metrics &shard(size_t worker) {
+    return shards[worker];
+  }
+  // prometheus text exposition format
+  std::string render(const backend_snapshot &snapshot, const connection_counters &counters) const;
+};
@@ -0,0 +1,58 @@
+#pragma once
+#include "backends.hpp"
+#include "connection.hpp"
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// a backend socket opened ahead of time, registered in the worker's epoll
+// while it connects and while it waits for a client.
+struct pooled_socket : endpoint {
+  int fd;
+  uint32_t backend;
+  // when the connect finished, in steady clock milliseconds
+  uint64_t since;
+  // monotonic_us() when the connect started, then how long it took
+  uint64_t connect_us;
+};
+
+// per worker pools of connected backend sockets, indexed by backend id. each
+// pool is refilled on maintain() to cover the accept rate the backend saw
+// recently, and idle sockets older than max_idle_ms are closed. like
+// connection slots, taken or evicted sockets are only freed on reclaim().
+class socket_pool {
+  struct backend_pool {
+    std::deque<pooled_socket*> ready;
+    std::vector<pooled_socket*> connecting;
+    uint32_t accepts = 0;
+    // ewma of accepts per second
+    float rate = 0;
+    bool valid = false;
+  };
+  std::vector<backend_pool> pools;
+  std::vector<pooled_socket*> released;
+  uint64_t last_tick = 0;
+  const int ep;
+
+  int open(const backend &server);
+  void release(pooled_socket *s);
+public:
+  static constexpr uint64_t TICK_MS = 100;
+  // seconds of accepts a pool holds sockets for
+  static constexpr float HORIZON = 0.25f;
+  // sockets per backend and worker, 0 disables pooling
+  static inline uint32_t max_size = 0;
+  static inline uint64_t max_idle_ms = 10000;
+
+  socket_pool(int &ep);
+  socket_pool(const socket_pool&) = delete;
+  socket_pool& operator=(const socket_pool&) = delete;
+  ~socket_pool();
+
+  // a connected socket to the backend or -1, the caller owns it.
+  // latency_us is how long its connect took
+  int take(uint32_t id, uint64_t &latency_us);
+  void handle_event(pooled_socket *s, uint32_t events);
+  void maintain(const backend_snapshot &snapshot);
+  void reclaim();
+};
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+
+// relays connections inside the kernel. both sockets of a connection join
+// sockhashes keyed by socket cookie, and an sk_skb stream verdict program
+// redirects whatever one of them receives to the send queue of its peer,
+// found through a hash map from cookie to peer cookie. workers only handle
+// setup and teardown of such connections.
+class sockmap_relay {
+  // sockets running the program, and sockets it may redirect to
+  int sockets_fd = -1;
+  int targets_fd = -1;
+  int peers_fd = -1;
+  int prog_fd = -1;
+public:
+  sockmap_relay() = default;
+  sockmap_relay(const sockmap_relay&) = delete;
+  sockmap_relay& operator=(const sockmap_relay&) = delete;
+  ~sockmap_relay();
+
+  // creates the maps and loads and attaches the program, -1 when the kernel
+  // or our privileges do not allow it
+  int init(uint32_t max_connections);
+  // cookies receives the cookies of a and b. when a socket could not join
+  // both are left out of the maps again.
+  int join(int a, int b, uint64_t cookies[2]);
+  void leave(const uint64_t cookies[2]);
+
+  // data bytes a socket received since it was opened
+  static uint64_t received(int fd);
+  // data bytes a socket received and that were read from it
+  static uint64_t consumed(int fd);
+  // data bytes queued on a socket for sending since it was opened
+  static uint64_t queued(int fd);
+};
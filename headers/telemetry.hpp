@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// a message from balancer-monitor about the backend it runs on.
+//
+// v1, 17 bytes: 0, seconds timestamp (u64), cpu (f32), mem (f32).
+// v2: 2, sequence (u32), milliseconds timestamp (u64), then fields of one
+// byte type, one byte length and a value. unknown types and known ones of
+// an unexpected length are skipped, so fields can be added without breaking
+// older proxies. all numbers are big endian.
+enum telemetry_field : uint8_t {
+  TELEMETRY_CPU = 1,
+  TELEMETRY_MEM = 2,
+  TELEMETRY_LOAD_AVERAGE = 3,
+  TELEMETRY_RUN_QUEUE = 4,
+  TELEMETRY_RX_RATE = 5,
+  TELEMETRY_TX_RATE = 6,
+  TELEMETRY_CONNECTIONS = 7,
+  TELEMETRY_CAPACITY = 8,
+  // address (u32) and port (u16) of the backend the monitor reports for
+  TELEMETRY_SERVER = 9,
+  // share of time some tasks stalled on the resource
+  TELEMETRY_CPU_PRESSURE = 10,
+  TELEMETRY_MEMORY_PRESSURE = 11,
+  TELEMETRY_IO_PRESSURE = 12,
+};
+
+struct telemetry {
+  static constexpr size_t V1_SIZE = 1 + sizeof(uint64_t) + sizeof(float) * 2;
+  static constexpr size_t V2_HEADER_SIZE = 1 + sizeof(uint32_t) + sizeof(uint64_t);
+  static constexpr size_t MAX_SIZE = 512;
+
+  uint8_t version = 2;
+  uint32_t sequence = 0;
+  uint64_t timestamp_ms = 0;
+  float cpu = 1;
+  float mem = 1;
+  // v2 only, v1 messages leave the defaults
+  float load_average = 0;
+  uint32_t run_queue = 0;
+  // bytes per second over all interfaces but loopback
+  uint64_t rx_rate = 0;
+  uint64_t tx_rate = 0;
+  uint32_t connections = 0;
+  // relative size of the backend, scales its share of the traffic
+  float capacity = 1;
+  float cpu_pressure = 0;
+  float memory_pressure = 0;
+  float io_pressure = 0;
+  // host order, only sent when server_port is set. lets a proxy with one
+  // telemetry socket for all backends tell apart backends sharing a host.
+  uint32_t server_address = 0;
+  uint16_t server_port = 0;
+
+  // -1 when the message is neither a v1 nor a well formed v2 one
+  int decode(const char *buf, size_t len);
+  // v2 with every field, returns the length written
+  size_t encode(char *buf) const;
+};
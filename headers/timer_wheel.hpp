@@ -0,0 +1,69 @@
+#pragma once
+#include "connection.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// hierarchical timing wheel of connection handles, in ticks of the caller's
+// choosing. LEVELS wheels of SLOTS slots each cover SLOTS^LEVELS ticks, a
+// timer further out is clamped to that range. an entry is never removed, the
+// owner checks on expiry whether it is still due and schedules it again if
+// not; entries of connections that are gone fail the handle lookup.
+class timer_wheel {
+public:
+  static constexpr uint32_t SLOT_BITS = 6;
+  static constexpr uint32_t SLOTS = 1 << SLOT_BITS;
+  static constexpr uint32_t LEVELS = 3;
+  static constexpr uint64_t RANGE = (uint64_t) 1 << (SLOT_BITS * LEVELS);
+
+  struct entry {
+    connection_handle handle;
+    uint64_t expires;
+  };
+private:
+  std::vector<entry> slots[LEVELS][SLOTS];
+  std::vector<entry> due;
+  uint64_t current = 0;
+  size_t count = 0;
+
+  void place(const entry &e);
+public:
+  // the first tick, before anything is scheduled
+  void start(uint64_t tick) {
+    current = tick;
+  }
+  uint64_t now() const {
+    return current;
+  }
+  size_t size() const {
+    return count;
+  }
+  // returns the tick the entry expires at after clamping
+  uint64_t schedule(connection_handle handle, uint64_t expires);
+
+  // moves the wheel up to tick, f is called for every entry that expired
+  template <typename F>
+  void advance(uint64_t tick, F&& f) {
+    while (current < tick) {
+      ++current;
+      // entries of the next turn of a lower wheel move down first
+      for (uint32_t level = 1; level < LEVELS; ++level) {
+        if (current & ((1ULL << (SLOT_BITS * level)) - 1)) {
+          break;
+        }
+        std::vector<entry> &slot = slots[level][(current >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        std::vector<entry> moved;
+        moved.swap(slot);
+        for (const entry &e : moved) {
+          place(e);
+        }
+      }
+      due.swap(slots[0][current & (SLOTS - 1)]);
+      count -= due.size();
+      for (const entry &e : due) {
+        f(e);
+      }
+      due.clear();
+    }
+  }
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+// minimal io_uring submission/completion ring driven through the raw system
+// calls, only what the worker backend needs.
+class uring {
+  int ring_fd = -1;
+  unsigned *sq_head = nullptr;
+  unsigned *sq_tail = nullptr;
+  unsigned *sq_mask = nullptr;
+  unsigned *sq_array = nullptr;
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned *cq_mask = nullptr;
+  io_uring_sqe *sqes = nullptr;
+  io_uring_cqe *cqes = nullptr;
+  void *sq_ptr = nullptr;
+  void *cq_ptr = nullptr;
+  size_t sq_len = 0;
+  size_t cq_len = 0;
+  size_t sqes_len = 0;
+  unsigned sq_entries = 0;
+  unsigned to_submit = 0;
+public:
+  uring() = default;
+  uring(const uring&) = delete;
+  uring& operator=(const uring&) = delete;
+  ~uring();
+
+  int init(unsigned entries);
+  io_uring_sqe *get_sqe();
+  int submit_and_wait(unsigned wait_nr);
+
+  template <typename F>
+  void for_each_cqe(F&& f) {
+    std::atomic_ref<unsigned> tail(*cq_tail);
+    std::atomic_ref<unsigned> head(*cq_head);
+    for (unsigned h = head.load(std::memory_order_relaxed); h != tail.load(std::memory_order_acquire); ++h) {
+      io_uring_cqe cqe = cqes[h & *cq_mask];
+      head.store(h + 1, std::memory_order_release);
+      f(cqe);
+    }
+  }
+};
@@ -1,130 +1,120 @@
 #pragma once
 
+#include "backends.hpp"
+#include "balancing.hpp"
 #include "connection.hpp"
-#include <cstdio>
-#include <cstdlib>
-#include <shared_mutex>
-#include <unistd.h>
-#include <unordered_map>
-#include <functional>
+#include "counters.hpp"
+#include "metrics.hpp"
+#include "pool.hpp"
+#include "sockmap.hpp"
+#include "timer_wheel.hpp"
+#include "uring.hpp"
+#include <atomic>
+#include <memory>
 #include <sys/epoll.h>
 #include <netinet/in.h>
-#include <iostream>
-#include <atomic>
+
+// operations submitted to a worker's io_uring, stored in the low byte of the
+// user data next to the handle of the connection they belong to.
+enum uring_op : uint8_t {
+  URING_ACCEPT,
+  URING_ACCEPT_CANCEL,
+  URING_CONNECT,
+  URING_UPSTREAM_READ,
+  URING_UPSTREAM_WRITE,
+  URING_DOWNSTREAM_READ,
+  URING_DOWNSTREAM_WRITE,
+  URING_CANCEL,
+  URING_CLOSE,
+  URING_WAKE,
+};
+
+enum class accept_state { idle, armed, canceling };
+
+// set by the control thread during a handoff: a standby worker does not
+// accept until its process is ready to take the listen sockets over, a
+// draining one accepts no more connections but relays the ones it has, a
+// stopping one returns
+enum class worker_mode : uint8_t { standby, serving, draining, stopping };
 
 struct worker {
   static constexpr size_t MAX_EVENTS = 511;
+  static constexpr unsigned URING_ENTRIES = 4096;
+  // how often connections handed to the kernel are asked whether their end
+  // of stream can be passed on
+  static constexpr int KERNEL_DRAIN_POLL_MS = 1;
+  static constexpr uint8_t MAX_JOIN_ATTEMPTS = 3;
+  // backends a connection tries before the client is given up on
+  static constexpr uint8_t MAX_CONNECT_ATTEMPTS = 3;
+  static constexpr uint64_t TIMER_TICK_MS = 100;
+  // 0 disables a timeout. linger applies once one direction is finished.
+  static inline uint64_t connect_timeout_ms = 10000;
+  static inline uint64_t idle_timeout_ms = 300000;
+  static inline uint64_t linger_timeout_ms = 30000;
   static inline int max_connections = 0;
-  std::atomic_int *number_of_connections;
-  std::atomic_bool *has_connections;
+  // backend connects carry bytes the client already sent in their SYN
+  static inline bool fastopen_connect = false;
+  // shared by all workers, null relays every connection through the pipes
+  static inline sockmap_relay *kernel_relay = nullptr;
+  connection_counters *counters;
+  worker_metrics *stats;
+  backend_registry *backends;
+  size_t id;
   connections_manager connections;
-  std::unordered_map<int, std::function<void(const epoll_event&)>> handlers;
+  balancer balance;
+  socket_pool pool;
+  std::vector<connection_handle> kernel_draining;
+  timer_wheel timers;
+  endpoint listener{nullptr, endpoint_state::listen};
+  endpoint timer_end{nullptr, endpoint_state::timer};
+  endpoint wake_end{nullptr, endpoint_state::wake};
+  std::unique_ptr<uring> ring;
+  accept_state accepting = accept_state::idle;
+  // the listen socket reported connections this worker has not accepted yet
+  bool has_connections = false;
   int epoll_fd;
+  int timer_fd;
+  bool timer_running = false;
+  std::atomic<worker_mode> mode{worker_mode::serving};
+  // an eventfd the control thread writes after changing the mode
+  int wake_fd;
 
-  worker(std::atomic_int *number_of_connections, std::atomic_bool *has_connections, int epoll_fd);
+  worker(connection_counters *counters, metrics_registry *metrics, backend_registry *backends, size_t id, int epoll_fd);
   ~worker();
 
-  template <typename Iter>
-  void run(Iter servers_begin, Iter servers_end, std::shared_mutex& sm, int listens_socket);
-  template<typename Iter>
-  void accept_connections(Iter servers_begin, Iter servers_end, std::shared_mutex& sm, int listens_socket);
-  void handle_server_connect(const epoll_event& ev);
-  void handle_data_transfer(const epoll_event& ev);
-  void handle_preread_client(const epoll_event &ev);
-  void on_client_connect(int client_fd, const sockaddr_in &addr);
-};
-
-bool valid_timestamp(uint64_t timestamp);
-
-template <typename Iter>
-Iter get_server(Iter begin, Iter end) {
-  float s = 0;
-  for (auto it = begin; it != end; ++it) {
-    std::tuple<sockaddr_in, size_t, float, float> cur = *it;
-    if (valid_timestamp(std::get<1>(cur))) {
-      float cur_m = std::get<2>(cur) * std::get<3>(cur);
-      cur_m < 1 && (s += (1 - cur_m));
-    }
-  }
-  float r = static_cast <float> (rand()) / (static_cast <float> (RAND_MAX / s));
-  if (r >= s) {
-    r = s;
-  }
-  s = 0;
-  for (auto it = begin; it != end; ++it) {
-    std::tuple<sockaddr_in, size_t, float, float> cur = *it;
-    if (valid_timestamp(std::get<1>(cur))) {
-      float cur_m = std::get<2>(cur) + std::get<3>(cur);
-      if (cur_m < 1 && (s += (1 - cur_m)) >= r) {
-        return it;
-      }
-    }
-  }
-  return end;
-}
+  void run(int listen_socket);
+  // from another thread
+  void set_mode(worker_mode next);
+  bool handle_wake(int listen_socket);
+  void accept_connections(int listen_socket);
+  void run_uring(int listen_socket);
+  void uring_handle_accept(int listen_socket, const io_uring_cqe &cqe);
+  void handle_event(endpoint *end, uint32_t events);
+  void handle_server_connect(connection *conn, uint32_t events);
+  void retry_connect(connection *conn);
+  void handle_data_transfer(connection *conn, endpoint *end, uint32_t events);
+  void handle_preread_client(connection *conn, uint32_t events);
+  void on_client_connect(int client_fd, const backend &server);
+  void relay(connection *conn);
+  void start_timer(connection *conn);
+  void arm_timer(connection *conn);
+  void handle_timer();
+  void handle_timeout(connection *conn, connection_handle h);
+  uint64_t phase_timeout_ms(const connection *conn) const;
+  uint64_t timeout_ticks(const connection *conn) const;
+  void join_kernel(connection *conn);
+  void relay_in_kernel(connection *conn);
+  void close_connection(connection *conn);
 
-template <typename Iter>
-void worker::accept_connections(Iter servers_begin, Iter servers_end, std::shared_mutex& sm, int listen_socket) {
-  while (*number_of_connections < max_connections) {
-    sm.lock_shared();
-    auto server = get_server(servers_begin, servers_end);
-    sm.unlock_shared();
-    if (server == servers_end) {
-      std::cerr << "no server available" << std::endl;
-      return;
-    }
-    int client = accept4(listen_socket, nullptr, nullptr, SOCK_NONBLOCK);
-    //std::cout << "accepted " << client << std::endl;
-    if (client < 0) {
-      *has_connections = false;
-      break;
-    }
-    
-    on_client_connect(client, std::get<0>(*server));
-    //std::cout << "done on client" << std::endl;
-  }
-}
-
-template <typename Iter>
-void worker::run(Iter servers_begin, Iter servers_end, std::shared_mutex& sm, int listen_socket) {
-  epoll_event *events = new epoll_event[MAX_EVENTS];
-  size_t events_size = MAX_EVENTS;
-  handlers[listen_socket] = [servers_begin, servers_end, this, &sm](const epoll_event &ev) {
-    *has_connections = true;
-    accept_connections(servers_begin, servers_end, sm, ev.data.fd);
-  };
-  while (true) {
-    if (*has_connections) {
-      accept_connections(servers_begin, servers_end, sm, listen_socket);
-    }
-    if (events_size < handlers.size()) {
-      epoll_event *events_new = new epoll_event[handlers.size()];
-      if (events_new == nullptr) {
-        perror(nullptr);
-        std::cerr << "failed to allocate memory" << std::endl;
-      }
-      else {
-        delete[] events;
-        events = events_new;
-        events_size = handlers.size();
-      }
-    }
-    ssize_t n = epoll_wait(epoll_fd, events, events_size, -1);
-    if (n < 0) {
-      perror(nullptr);
-      std::cerr << "epoll_wait failed" << std::endl;
-      continue;
-    }
-    for (ssize_t i = 0; i < n; ++i) {
-      auto it = handlers.find(events[i].data.fd);
-      if (it == handlers.end()) {
-        std::cerr << "no handler for fd " << events[i].data.fd << std::endl;
-        epoll_del(epoll_fd, events[i].data.fd);
-        close(events[i].data.fd);
-        continue;
-      }
-      it->second(events[i]);
-    }
-  }
-  delete[] events;
-}
+  int init_uring();
+  void uring_accept(int listen_socket);
+  void uring_cancel_accept(int listen_socket);
+  void uring_wait_wake();
+  void uring_on_client_connect(int client_fd, const backend &server);
+  int uring_connect(connection *conn, const backend &server);
+  void uring_retry_connect(connection *conn);
+  void uring_handle_completion(const io_uring_cqe &cqe);
+  void uring_advance(connection *conn, channel &ch, int src, int dst, bool dst_ready, uring_op read_op, uring_op write_op);
+  void uring_close_connection(connection *conn);
+  void uring_release(connection *conn);
+};
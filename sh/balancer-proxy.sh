@@ -1,4 +1,4 @@
 #! /bin/sh
 
-read -a args -d EOF < /etc/balancer/proxy.conf
-$(dirname $(realpath $0))/balancer-proxy ${args[@]}
+# exec keeps the proxy's pid the service's main pid, so a reload's SIGHUP reaches it
+exec $(dirname $(realpath $0))/balancer-proxy --config /etc/balancer/proxy.conf
@@ -0,0 +1,33 @@
+#! /bin/sh
+
+# runs balancer-loadgen against a balancer-echo backend, once directly and
+# once through balancer-proxy, with the backend also standing in for
+# balancer-monitor. LOAD_ARGS replaces the default scenarios with a single
+# run of balancer-loadgen, PROXY_ARGS adds options of balancer-proxy.
+bin=$(dirname $(realpath $0))/../bin
+host=127.0.0.1
+port=${BENCH_PORT:-18000}
+duration=${BENCH_DURATION:-5}
+
+"$bin/balancer-echo" --monitor $host $((port + 2)) $host $((port + 1)) &
+backend=$!
+"$bin/balancer-proxy" $PROXY_ARGS 100000 $host $port $host $((port + 1)) $host $((port + 2)) > /dev/null &
+proxy=$!
+trap 'kill $backend $proxy 2> /dev/null' EXIT INT TERM
+# the proxy only picks a backend once its telemetry arrived
+sleep 2
+
+run() {
+  echo "== $1: $2"
+  echo "-- direct"
+  "$bin/balancer-loadgen" --duration $duration $2 $host $((port + 1))
+  echo "-- proxy"
+  "$bin/balancer-loadgen" --duration $duration $2 $host $port
+}
+
+if [ -n "$LOAD_ARGS" ]; then
+  run custom "$LOAD_ARGS"
+else
+  run "short connections" "--connections 64 --requests 1 --size 1024"
+  run "long connections" "--connections 64 --requests 1000 --size 65536 --mix 1,1,1"
+fi
@@ -0,0 +1,125 @@
+#include "../headers/backends.hpp"
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+bool valid_timestamp(uint64_t timestamp) {
+  return timestamp > (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>((std::chrono::system_clock::now() - std::chrono::milliseconds(TELEMETRY_TTL_MS)).time_since_epoch()).count();
+}
+
+static uint32_t hash_address(const sockaddr_in &address, uint32_t seed) {
+  uint64_t h = ((uint64_t) address.sin_addr.s_addr << 16 | address.sin_port) ^ seed;
+  h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdULL;
+  h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ULL;
+  return h ^ (h >> 33);
+}
+
+maglev_table::maglev_table(const std::vector<backend> &backends, const std::vector<uint32_t> &members)
+  : members(members), entries(SIZE, UINT32_MAX) {
+  if (members.empty()) {
+    return;
+  }
+  std::vector<uint64_t> offset, skip, next(members.size(), 0);
+  for (uint32_t k : members) {
+    offset.push_back(hash_address(backends[k].address, 0x5bd1e995) % SIZE);
+    skip.push_back(hash_address(backends[k].address, 0x1b873593) % (SIZE - 1) + 1);
+  }
+  // backends take turns claiming the next free entry of their permutation
+  uint32_t filled = 0;
+  while (true) {
+    for (size_t i = 0; i < members.size(); ++i) {
+      uint64_t c = (offset[i] + next[i] * skip[i]) % SIZE;
+      while (entries[c] != UINT32_MAX) {
+        c = (offset[i] + ++next[i] * skip[i]) % SIZE;
+      }
+      entries[c] = members[i];
+      ++next[i];
+      if (++filled == SIZE) {
+        return;
+      }
+    }
+  }
+}
+
+bool backend_snapshot::expired() const {
+  for (uint32_t k : valid) {
+    if (!valid_timestamp(backends[k].timestamp)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void backend_snapshot::prepare() {
+  max_id = 0;
+  valid.clear();
+  prefix.clear();
+  schedule.clear();
+  float sum = 0;
+  std::vector<std::pair<float, uint32_t>> slots;
+  for (uint32_t k = 0; k < backends.size(); ++k) {
+    const backend &cur = backends[k];
+    max_id = std::max(max_id, cur.id);
+    float w = cur.weight();
+    if (w <= 0 || cur.ejected || cur.draining || !valid_timestamp(cur.timestamp)) {
+      continue;
+    }
+    valid.push_back(k);
+    prefix.push_back(sum += w);
+    // the j-th turn of a backend is due at (j + 0.5) / units, sorting the
+    // turns interleaves backends instead of running them in blocks
+    uint32_t units = std::max(1u, (uint32_t) (w * WRR_UNITS + 0.5f));
+    for (uint32_t j = 0; j < units; ++j) {
+      slots.emplace_back((j + 0.5f) / units, k);
+    }
+  }
+  std::sort(slots.begin(), slots.end());
+  schedule.reserve(slots.size());
+  for (auto &slot : slots) {
+    schedule.push_back(slot.second);
+  }
+  // most telemetry only changes loads, the table only follows membership
+  if (!consistent_hash) {
+    maglev.reset();
+  }
+  else if (!maglev || maglev->members != valid) {
+    maglev = std::make_shared<const maglev_table>(backends, valid);
+  }
+}
+
+backend_registry::backend_registry(size_t readers_count, backend_snapshot *initial)
+  : current(initial), readers(std::make_unique<reader_state[]>(readers_count)), readers_count(readers_count) {}
+
+backend_registry::~backend_registry() {
+  for (auto &r : retired) {
+    delete r.snapshot;
+  }
+  delete current.load();
+}
+
+void backend_registry::publish(backend_snapshot *next) {
+  next->prepare();
+  const backend_snapshot *previous = current.exchange(next);
+  retired.push_back({epoch.fetch_add(1) + 1, previous});
+  reclaim();
+}
+
+void backend_registry::reclaim() {
+  uint64_t oldest = UINT64_MAX;
+  for (size_t k = 0; k < readers_count; ++k) {
+    uint64_t seen = readers[k].seen.load();
+    if (seen && seen < oldest) {
+      oldest = seen;
+    }
+  }
+  size_t kept = 0;
+  for (auto &r : retired) {
+    if (r.epoch <= oldest) {
+      delete r.snapshot;
+    }
+    else {
+      retired[kept++] = r;
+    }
+  }
+  retired.resize(kept);
+}
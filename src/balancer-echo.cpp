@@ -0,0 +1,230 @@
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "../headers/bench.hpp"
+#include "../headers/telemetry.hpp"
+
+static constexpr size_t BUFFER_SIZE = 256 << 10;
+static constexpr int MAX_EVENTS = 256;
+
+static const char USAGE[] = "balancer-echo [options] <listen address> <listen port>\n"
+  "answers balancer-loadgen requests, one epoll loop per thread\n"
+  "options:\n"
+  "  --threads <n>\tthreads, each with its own SO_REUSEPORT listen socket (default all cpus)\n"
+  "  --monitor <address> <port>\tsend telemetry to a proxy's monitor socket twice a second\n"
+  "  --cpu <load>\tcpu usage reported in the telemetry (default 0)\n"
+  "  --mem <load>\tmemory usage reported in the telemetry (default 0)\n"
+  "  --capacity <weight>\tcapacity weight reported in the telemetry (default 1)\n";
+
+static const option LONG_OPTIONS[] = {
+  {"threads", required_argument, nullptr, 'n'},
+  {"monitor", required_argument, nullptr, 'm'},
+  {"cpu", required_argument, nullptr, 'c'},
+  {"mem", required_argument, nullptr, 'M'},
+  {"capacity", required_argument, nullptr, 'w'},
+  {nullptr, 0, nullptr, 0}
+};
+
+struct session {
+  int fd;
+  char header[bench_request::SIZE] = {};
+  size_t header_read = 0;
+  uint64_t to_read = 0;
+  uint64_t to_write = 0;
+};
+
+// reads requests and writes their responses until the socket would block,
+// returns -1 once the session is over
+static int serve(session &s, char *buf) {
+  while (true) {
+    if (s.to_write) {
+      ssize_t n = send(s.fd, buf, s.to_write < BUFFER_SIZE ? s.to_write : BUFFER_SIZE, MSG_NOSIGNAL);
+      if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+      }
+      s.to_write -= n;
+      continue;
+    }
+    size_t want = s.header_read < bench_request::SIZE ? bench_request::SIZE - s.header_read : (s.to_read < BUFFER_SIZE ? s.to_read : BUFFER_SIZE);
+    ssize_t n = recv(s.fd, s.header_read < bench_request::SIZE ? s.header + s.header_read : buf, want, 0);
+    if (n <= 0) {
+      return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    if (s.header_read < bench_request::SIZE) {
+      s.header_read += n;
+      if (s.header_read < bench_request::SIZE) {
+        continue;
+      }
+      s.to_read = bench_request::decode(s.header).request_size;
+    }
+    else {
+      s.to_read -= n;
+    }
+    if (!s.to_read) {
+      s.to_write = bench_request::decode(s.header).response_size;
+      s.header_read = 0;
+    }
+  }
+}
+
+static int init_listen(const sockaddr_in &addr) {
+  int listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listen_socket < 0) {
+    perror(nullptr);
+    return -1;
+  }
+  const int opt = 1;
+  if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0
+      || setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0
+      || bind(listen_socket, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0
+      || listen(listen_socket, SOMAXCONN) < 0) {
+    perror(nullptr);
+    close(listen_socket);
+    return -1;
+  }
+  return listen_socket;
+}
+
+static void run(int listen_socket) {
+  int ep = epoll_create1(0);
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;
+  if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, listen_socket, &ev) < 0) {
+    perror(nullptr);
+    std::cerr << "failed to set up the event loop" << std::endl;
+    return;
+  }
+  std::vector<char> buf(BUFFER_SIZE, 0);
+  epoll_event events[MAX_EVENTS];
+  while (true) {
+    int n = epoll_wait(ep, events, MAX_EVENTS, -1);
+    for (int k = 0; k < n; ++k) {
+      session *s = static_cast<session*>(events[k].data.ptr);
+      if (!s) {
+        int fd;
+        while ((fd = accept4(listen_socket, nullptr, nullptr, SOCK_NONBLOCK)) >= 0) {
+          const int opt = 1;
+          setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+          s = new session{fd};
+          epoll_event client_ev{};
+          client_ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+          client_ev.data.ptr = s;
+          if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &client_ev) < 0) {
+            close(fd);
+            delete s;
+          }
+        }
+        continue;
+      }
+      if (events[k].events & EPOLLERR || serve(*s, buf.data()) < 0) {
+        close(s->fd);
+        delete s;
+      }
+    }
+  }
+}
+
+// pretends to be balancer-monitor, so the proxy has telemetry for the backend
+static void report(sockaddr_in target, telemetry load) {
+  int broadcast_socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (broadcast_socket < 0) {
+    perror(nullptr);
+    return;
+  }
+  while (true) {
+    ++load.sequence;
+    load.timestamp_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    char buf[telemetry::MAX_SIZE];
+    size_t len = load.encode(buf);
+    sendto(broadcast_socket, buf, len, 0, reinterpret_cast<const sockaddr*>(&target), sizeof(target));
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+}
+
+int main(int argc, char *argv[]) {
+  size_t threads = std::thread::hardware_concurrency();
+  const char *monitor_address = nullptr;
+  uint16_t monitor_port = 0;
+  telemetry load;
+  load.cpu = 0;
+  load.mem = 0;
+  for (int opt; (opt = getopt_long(argc, argv, "+", LONG_OPTIONS, nullptr)) != -1;) {
+    switch (opt) {
+    case 'n':
+      threads = strtoul(optarg, nullptr, 10);
+      break;
+    case 'm':
+      if (optind >= argc) {
+        std::cerr << USAGE;
+        return 1;
+      }
+      monitor_address = optarg;
+      monitor_port = atoi(argv[optind++]);
+      break;
+    case 'c':
+      load.cpu = atof(optarg);
+      break;
+    case 'M':
+      load.mem = atof(optarg);
+      break;
+    case 'w':
+      load.capacity = atof(optarg);
+      break;
+    default:
+      std::cerr << USAGE;
+      return 1;
+    }
+  }
+  if (argc - optind != 2 || !threads) {
+    std::cerr << USAGE;
+    return 1;
+  }
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(argv[optind]);
+  addr.sin_port = htons(atoi(argv[optind + 1]));
+
+  // every socket is open before a thread starts, so a failure leaves none to join
+  std::vector<int> listen_sockets;
+  for (size_t k = 0; k < threads; ++k) {
+    int listen_socket = init_listen(addr);
+    if (listen_socket < 0) {
+      std::cerr << "failed to listen on " << argv[optind] << " " << argv[optind + 1] << std::endl;
+      for (int fd : listen_sockets) {
+        close(fd);
+      }
+      return 1;
+    }
+    listen_sockets.push_back(listen_socket);
+  }
+  std::vector<std::thread> workers;
+  for (int listen_socket : listen_sockets) {
+    workers.emplace_back(run, listen_socket);
+  }
+  if (monitor_address) {
+    sockaddr_in target{};
+    target.sin_family = AF_INET;
+    target.sin_addr.s_addr = inet_addr(monitor_address);
+    target.sin_port = htons(monitor_port);
+    // names the backend, for proxies with one telemetry socket for all of them
+    load.server_address = ntohl(addr.sin_addr.s_addr);
+    load.server_port = ntohs(addr.sin_port);
+    workers.emplace_back(report, target, load);
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+  return 0;
+}
@@ -0,0 +1,343 @@
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "../headers/bench.hpp"
+#include "../headers/metrics.hpp"
+
+static constexpr size_t BUFFER_SIZE = 256 << 10;
+static constexpr int MAX_EVENTS = 256;
+
+static const char USAGE[] = "balancer-loadgen [options] <address> <port>\n"
+  "opens connections to a balancer-echo backend, directly or through the proxy, and reports what they achieved\n"
+  "options:\n"
+  "  --threads <n>\tthreads, each with its own epoll loop (default all cpus)\n"
+  "  --connections <n>\tconnections open at the same time, over all threads (default 64)\n"
+  "  --rate <n>\tnew connections per second over all threads, 0 opens one as soon as another closed (default 0)\n"
+  "  --requests <n>\trequests sent one after the other on every connection (default 1)\n"
+  "  --size <bytes>\tpayload of a request or response (default 1024)\n"
+  "  --mix <echo,upload,download>\trelative weights of the request kinds (default 1,0,0)\n"
+  "  --duration <seconds>\thow long to keep opening connections (default 10)\n";
+
+static const option LONG_OPTIONS[] = {
+  {"threads", required_argument, nullptr, 'n'},
+  {"connections", required_argument, nullptr, 'c'},
+  {"rate", required_argument, nullptr, 'r'},
+  {"requests", required_argument, nullptr, 'q'},
+  {"size", required_argument, nullptr, 's'},
+  {"mix", required_argument, nullptr, 'm'},
+  {"duration", required_argument, nullptr, 'd'},
+  {nullptr, 0, nullptr, 0}
+};
+
+struct load_options {
+  sockaddr_in address{};
+  size_t connections = 64;
+  double rate = 0;
+  uint32_t requests = 1;
+  uint32_t size = 1024;
+  uint32_t mix[3] = {1, 0, 0};
+  uint64_t duration_us = 10000000;
+};
+
+// what one thread did, merged once all of them finished
+struct load_result {
+  uint64_t connections = 0;
+  uint64_t failed = 0;
+  uint64_t requests = 0;
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  latency_histogram connect_latency;
+  latency_histogram request_latency;
+};
+
+struct client_state {
+  int fd;
+  bool connected = false;
+  uint32_t requests_left = 0;
+  bench_request request{};
+  char header[bench_request::SIZE] = {};
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  uint64_t started = 0;
+};
+
+class load_thread {
+  const load_options &options;
+  load_result &result;
+  size_t connections;
+  double rate;
+  int ep;
+  std::vector<char> buf;
+  std::minstd_rand rng;
+  size_t open = 0;
+  uint64_t opened = 0;
+
+  void start_request(client_state &c);
+  void open_client();
+  void close_client(client_state *c, bool failed);
+  int advance(client_state &c);
+public:
+  load_thread(const load_options &options, load_result &result, size_t connections, double rate, uint32_t seed)
+    : options(options), result(result), connections(connections), rate(rate), ep(epoll_create1(0)), buf(BUFFER_SIZE, 0), rng(seed) {}
+  ~load_thread() {
+    close(ep);
+  }
+  void run();
+};
+
+void load_thread::start_request(client_state &c) {
+  uint32_t total = options.mix[0] + options.mix[1] + options.mix[2];
+  uint32_t pick = rng() % total;
+  if (pick < options.mix[0]) {
+    c.request = {options.size, options.size};
+  }
+  else if (pick < options.mix[0] + options.mix[1]) {
+    c.request = {options.size, 1};
+  }
+  else {
+    c.request = {0, options.size};
+  }
+  c.request.encode(c.header);
+  c.sent = 0;
+  c.received = 0;
+  c.started = monotonic_us();
+}
+
+void load_thread::open_client() {
+  ++opened;
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    ++result.failed;
+    return;
+  }
+  const int opt = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  client_state *c = new client_state{fd};
+  c->requests_left = options.requests;
+  c->started = monotonic_us();
+  epoll_event ev{};
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = c;
+  if ((connect(fd, reinterpret_cast<const sockaddr*>(&options.address), sizeof(options.address)) < 0 && errno != EINPROGRESS)
+      || epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    close(fd);
+    delete c;
+    ++result.failed;
+    return;
+  }
+  ++open;
+}
+
+void load_thread::close_client(client_state *c, bool failed) {
+  close(c->fd);
+  if (failed) {
+    ++result.failed;
+  }
+  else {
+    ++result.connections;
+  }
+  delete c;
+  --open;
+}
+
+// moves a client along until its socket would block, returns 1 once all of
+// its requests were answered and -1 on failure
+int load_thread::advance(client_state &c) {
+  if (!c.connected) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+      return -1;
+    }
+    c.connected = true;
+    result.connect_latency.record(monotonic_us() - c.started);
+    start_request(c);
+  }
+  while (true) {
+    uint64_t to_send = bench_request::SIZE + c.request.request_size;
+    if (c.sent < to_send) {
+      ssize_t n;
+      if (c.sent < bench_request::SIZE) {
+        n = send(c.fd, c.header + c.sent, bench_request::SIZE - c.sent, MSG_NOSIGNAL | (c.request.request_size ? MSG_MORE : 0));
+      }
+      else {
+        uint64_t left = to_send - c.sent;
+        n = send(c.fd, buf.data(), left < BUFFER_SIZE ? left : BUFFER_SIZE, MSG_NOSIGNAL);
+      }
+      if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+      }
+      c.sent += n;
+      result.sent += n;
+      continue;
+    }
+    uint64_t left = c.request.response_size - c.received;
+    ssize_t n = recv(c.fd, buf.data(), left < BUFFER_SIZE ? left : BUFFER_SIZE, 0);
+    if (n <= 0) {
+      return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    c.received += n;
+    result.received += n;
+    if (c.received < c.request.response_size) {
+      continue;
+    }
+    result.request_latency.record(monotonic_us() - c.started);
+    ++result.requests;
+    if (!--c.requests_left) {
+      return 1;
+    }
+    start_request(c);
+  }
+}
+
+void load_thread::run() {
+  epoll_event events[MAX_EVENTS];
+  uint64_t start = monotonic_us();
+  uint64_t end = start + options.duration_us;
+  uint64_t now = start;
+  while (now < end) {
+    // with a rate connections are opened on schedule, never more at once
+    // than allowed
+    uint64_t due = rate > 0 ? (uint64_t) ((now - start) * rate / 1e6) + 1 : UINT64_MAX;
+    while (open < connections && opened < due) {
+      open_client();
+    }
+    int n = epoll_wait(ep, events, MAX_EVENTS, rate > 0 ? 1 : 100);
+    for (int k = 0; k < n; ++k) {
+      client_state *c = static_cast<client_state*>(events[k].data.ptr);
+      int r = events[k].events & EPOLLERR ? -1 : advance(*c);
+      if (r) {
+        close_client(c, r < 0);
+      }
+    }
+    now = monotonic_us();
+  }
+}
+
+static uint64_t percentile(const std::vector<uint64_t> &buckets, uint64_t total, double q) {
+  uint64_t rank = (uint64_t) (q * total);
+  uint64_t cumulative = 0;
+  for (uint32_t b = 0; b < buckets.size(); ++b) {
+    cumulative += buckets[b];
+    if (cumulative > rank) {
+      return latency_histogram::upper_bound(b);
+    }
+  }
+  return 0;
+}
+
+static void print_latency(const char *name, const std::vector<std::unique_ptr<load_result>> &results, latency_histogram load_result::*field) {
+  std::vector<uint64_t> buckets(latency_histogram::BUCKETS, 0);
+  uint64_t total = 0;
+  uint64_t sum = 0;
+  for (const auto &r : results) {
+    const latency_histogram &h = (*r).*field;
+    for (uint32_t b = 0; b < latency_histogram::BUCKETS; ++b) {
+      buckets[b] += h.count(b);
+      total += h.count(b);
+    }
+    sum += h.sum();
+  }
+  std::cout << name << " latency us: mean " << (total ? sum / total : 0) << " p50 " << percentile(buckets, total, 0.5)
+            << " p99 " << percentile(buckets, total, 0.99) << " p999 " << percentile(buckets, total, 0.999) << std::endl;
+}
+
+static int parse_mix(const char *arg, uint32_t mix[3]) {
+  if (sscanf(arg, "%u,%u,%u", &mix[0], &mix[1], &mix[2]) != 3 || !(mix[0] + mix[1] + mix[2])) {
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  load_options options;
+  size_t threads = std::thread::hardware_concurrency();
+  for (int opt; (opt = getopt_long(argc, argv, "+", LONG_OPTIONS, nullptr)) != -1;) {
+    switch (opt) {
+    case 'n':
+      threads = strtoul(optarg, nullptr, 10);
+      break;
+    case 'c':
+      options.connections = strtoul(optarg, nullptr, 10);
+      break;
+    case 'r':
+      options.rate = atof(optarg);
+      break;
+    case 'q':
+      options.requests = strtoul(optarg, nullptr, 10);
+      break;
+    case 's':
+      options.size = strtoul(optarg, nullptr, 10);
+      break;
+    case 'm':
+      if (parse_mix(optarg, options.mix) < 0) {
+        std::cerr << "incorrect mix " << optarg << std::endl << USAGE;
+        return 1;
+      }
+      break;
+    case 'd':
+      options.duration_us = atof(optarg) * 1e6;
+      break;
+    default:
+      std::cerr << USAGE;
+      return 1;
+    }
+  }
+  if (argc - optind != 2 || !threads || !options.requests || !options.size) {
+    std::cerr << USAGE;
+    return 1;
+  }
+  if (threads > options.connections) {
+    threads = options.connections;
+  }
+  options.address.sin_family = AF_INET;
+  options.address.sin_addr.s_addr = inet_addr(argv[optind]);
+  options.address.sin_port = htons(atoi(argv[optind + 1]));
+
+  std::vector<std::unique_ptr<load_result>> results;
+  std::vector<std::thread> workers;
+  for (size_t k = 0; k < threads; ++k) {
+    results.push_back(std::make_unique<load_result>());
+  }
+  for (size_t k = 0; k < threads; ++k) {
+    // connections and rate are split evenly, the first threads take the rest
+    size_t connections = options.connections / threads + (k < options.connections % threads);
+    workers.emplace_back([&options, &results, k, connections, threads] {
+      load_thread t(options, *results[k], connections, options.rate / threads, k + 1);
+      t.run();
+    });
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+
+  load_result total;
+  for (const auto &r : results) {
+    total.connections += r->connections;
+    total.failed += r->failed;
+    total.requests += r->requests;
+    total.sent += r->sent;
+    total.received += r->received;
+  }
+  double seconds = options.duration_us / 1e6;
+  std::cout << std::fixed << std::setprecision(1)
+            << "connections " << total.connections << " (" << total.connections / seconds << "/s) failed " << total.failed << std::endl
+            << "requests " << total.requests << " (" << total.requests / seconds << "/s)" << std::endl
+            << "throughput MiB/s: sent " << total.sent / seconds / (1 << 20) << " received " << total.received / seconds / (1 << 20) << std::endl;
+  print_latency("connect", results, &load_result::connect_latency);
+  print_latency("request", results, &load_result::request_latency);
+  return total.requests ? 0 : 1;
+}
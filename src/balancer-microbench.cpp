@@ -0,0 +1,422 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <getopt.h>
+#include <iostream>
+#include <random>
+#include <string>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include "../headers/balancing.hpp"
+#include "../headers/connection.hpp"
+#include "../headers/telemetry.hpp"
+#include "../headers/metrics.hpp"
+
+static constexpr int REPEATS = 5;
+
+static const char USAGE[] = "balancer-microbench [options]\n"
+  "times the proxy's hot data structures in isolation, one json object per line\n"
+  "options:\n"
+  "  --filter <text>\tonly run benchmarks whose name contains text\n"
+  "  --min-time <ms>\tshortest run a measurement is scaled up to (default 20)\n";
+
+static const option LONG_OPTIONS[] = {
+  {"filter", required_argument, nullptr, 'f'},
+  {"min-time", required_argument, nullptr, 't'},
+  {nullptr, 0, nullptr, 0}
+};
+
+// keeps the compiler from dropping a computation whose result is unused
+template <typename T>
+static void keep(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class harness {
+  std::string filter;
+  uint64_t min_time_ns;
+
+  template <typename F>
+  static uint64_t time_ns(F &f, uint64_t ops) {
+    auto start = std::chrono::steady_clock::now();
+    f(ops);
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+public:
+  harness(std::string filter, uint64_t min_time_ns) : filter(std::move(filter)), min_time_ns(min_time_ns) {}
+
+  bool wanted(const std::string &name) const {
+    return name.find(filter) != std::string::npos;
+  }
+
+  // f(ops) performs ops operations. the count is doubled until a run takes
+  // min_time_ns, then REPEATS runs of it are timed and the fastest and the
+  // median are reported. params is a json fragment of the inputs.
+  template <typename F>
+  void run(const std::string &name, const std::string &params, F &&f) {
+    if (!wanted(name)) {
+      return;
+    }
+    uint64_t ops = 1;
+    while (time_ns(f, ops) < min_time_ns && ops < (1ULL << 40)) {
+      ops *= 2;
+    }
+    std::vector<double> per_op;
+    for (int k = 0; k < REPEATS; ++k) {
+      per_op.push_back((double) time_ns(f, ops) / ops);
+    }
+    std::sort(per_op.begin(), per_op.end());
+    std::cout << "{\"benchmark\":\"" << name << "\"" << (params.empty() ? "" : ",") << params
+              << ",\"ops\":" << ops << ",\"ns_per_op\":" << per_op[0] << ",\"median_ns_per_op\":" << per_op[REPEATS / 2] << "}" << std::endl;
+  }
+};
+
+static backend_snapshot make_snapshot(uint32_t count, std::mt19937 &rng) {
+  std::uniform_real_distribution<float> load(0, 1);
+  uint64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  backend_snapshot snapshot;
+  for (uint32_t k = 0; k < count; ++k) {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(0x0a000000 | k);
+    address.sin_port = htons(80);
+    snapshot.backends.push_back({address, now * 1000, load(rng), load(rng), k});
+  }
+  snapshot.prepare();
+  return snapshot;
+}
+
+// picks a backend for every operation, connections opened on the picked
+// backend are closed again OPEN_WINDOW picks later so the counts that
+// least-conn and p2c look at keep moving
+static void bench_get_server(harness &h) {
+  static constexpr size_t OPEN_WINDOW = 1024;
+  const std::pair<const char*, strategy> strategies[] = {
+    {"telemetry", strategy::telemetry},
+    {"p2c", strategy::p2c},
+    {"least-conn", strategy::least_conn},
+    {"wrr", strategy::wrr},
+    {"maglev", strategy::maglev},
+    {"peak-ewma", strategy::peak_ewma},
+  };
+  if (!h.wanted("get_server")) {
+    return;
+  }
+  std::mt19937 rng(1);
+  for (uint32_t count : {2, 16, 128, 1024}) {
+    metrics_registry metrics(1, count);
+    for (const auto &[name, mode] : strategies) {
+      balancer::mode = mode;
+      backend_snapshot::consistent_hash = mode == strategy::maglev;
+      backend_snapshot snapshot = make_snapshot(count, rng);
+      balancer balance(1, &metrics.shard(0));
+      std::vector<uint32_t> opened(OPEN_WINDOW, UINT32_MAX);
+      uint64_t pick = 0;
+      sockaddr_in client{};
+      client.sin_family = AF_INET;
+      client.sin_addr.s_addr = htonl(0xc0a80001);
+      h.run("get_server", "\"strategy\":\"" + std::string(name) + "\",\"backends\":" + std::to_string(count), [&](uint64_t ops) {
+        for (uint64_t k = 0; k < ops; ++k, ++pick) {
+          client.sin_port = htons(pick);
+          const backend *server = balance.get_server(snapshot, client);
+          keep(server);
+          uint32_t &slot = opened[pick % OPEN_WINDOW];
+          if (slot != UINT32_MAX) {
+            balance.on_close(slot);
+          }
+          slot = server ? server->id : UINT32_MAX;
+          if (server) {
+            balance.on_open(server->id);
+          }
+        }
+      });
+      for (uint32_t id : opened) {
+        if (id != UINT32_MAX) {
+          balance.on_close(id);
+        }
+      }
+    }
+  }
+  balancer::mode = strategy::telemetry;
+  backend_snapshot::consistent_hash = false;
+}
+
+// a worker reclaims after every epoll batch, which holds at most this many
+// events
+static constexpr uint64_t RECLAIM_EVERY = 511;
+
+// the manager closes the connections still live when it goes out of scope,
+// before the caller closes ep
+static void bench_remove_reclaim(harness &h, int &ep, uint32_t live) {
+  connections_manager connections(ep);
+  std::vector<int> clients(live, -1);
+  auto add = [&](uint32_t k) {
+    int fds[2];
+    clients[k] = -1;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+      return false;
+    }
+    connection conn;
+    conn.client = fds[0];
+    conn.server = fds[1];
+    conn.upstream.pipes[0] = conn.downstream.pipes[0] = -1;
+    connection *added = connections.add(conn);
+    epoll_add(ep, added->client, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &added->client_end);
+    epoll_add(ep, added->server, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &added->server_end);
+    clients[k] = fds[0];
+    return true;
+  };
+  bool opened = true;
+  for (uint32_t k = 0; k < live && opened; ++k) {
+    opened = add(k);
+  }
+  uint64_t oldest = 0;
+  if (opened) {
+    h.run("connections_remove_reclaim", "\"live\":" + std::to_string(live), [&](uint64_t ops) {
+      for (uint64_t k = 0; k < ops; ++k, ++oldest) {
+        uint32_t slot = oldest % live;
+        connections.remove(clients[slot]);
+        add(slot);
+        if (oldest % RECLAIM_EVERY == RECLAIM_EVERY - 1) {
+          connections.reclaim();
+        }
+      }
+    });
+  }
+  else {
+    perror(nullptr);
+    std::cerr << "failed to open " << live << " socketpairs for connections_remove_reclaim" << std::endl;
+  }
+}
+
+// live connections stay at a fixed count while the oldest is replaced by a
+// new one. remove_reclaim goes the way a worker does, through a socketpair
+// registered in epoll, remove and a reclaim per batch, so it includes the
+// syscalls. detach_add makes the fds up and only times the slots and the fd
+// table.
+static void bench_connections(harness &h) {
+  if (!h.wanted("connections")) {
+    return;
+  }
+  rlimit files{};
+  getrlimit(RLIMIT_NOFILE, &files);
+  for (uint32_t live : {1024, 8192}) {
+    // both ends of every pair, with room for the ones being replaced
+    if (2 * live + 64 > files.rlim_cur) {
+      std::cerr << "not enough fds for " << live << " live connections, skipping connections_remove_reclaim" << std::endl;
+      continue;
+    }
+    int ep = epoll_create1(0);
+    if (ep < 0) {
+      perror(nullptr);
+      std::cerr << "failed to create epoll for connections_remove_reclaim" << std::endl;
+      return;
+    }
+    bench_remove_reclaim(h, ep, live);
+    close(ep);
+  }
+  for (uint32_t live : {1024, 65536}) {
+    int ep = -1;
+    connections_manager connections(ep);
+    // a connection holds fds 2k and 2k + 1 of its slot in the ring
+    std::vector<connection_handle> ring(live);
+    auto add = [&](uint32_t k) {
+      connection conn;
+      conn.client = 1000 + 2 * k;
+      conn.server = 1000 + 2 * k + 1;
+      ring[k] = connections.add(conn)->handle();
+    };
+    for (uint32_t k = 0; k < live; ++k) {
+      add(k);
+    }
+    uint64_t oldest = 0;
+    std::string params = "\"live\":" + std::to_string(live);
+    h.run("connections_detach_add", params, [&](uint64_t ops) {
+      for (uint64_t k = 0; k < ops; ++k, ++oldest) {
+        uint32_t slot = oldest % live;
+        connections.detach(1000 + 2 * slot);
+        add(slot);
+      }
+    });
+    std::minstd_rand rng(1);
+    h.run("connections_get_fd", params, [&](uint64_t ops) {
+      for (uint64_t k = 0; k < ops; ++k) {
+        keep(connections.get((int) (1000 + rng() % (2 * live))));
+      }
+    });
+    h.run("connections_get_handle", params, [&](uint64_t ops) {
+      for (uint64_t k = 0; k < ops; ++k) {
+        keep(connections.get(ring[rng() % live]));
+      }
+    });
+    for (uint32_t k = 0; k < live; ++k) {
+      connections.detach(1000 + 2 * k);
+    }
+  }
+}
+
+// the control thread's fd to handler map, looked up and called per event
+static void bench_router(harness &h) {
+  if (!h.wanted("router_dispatch")) {
+    return;
+  }
+  for (int handlers : {4, 64}) {
+    std::unordered_map<int, std::function<void(const epoll_event&)>> router;
+    uint64_t handled = 0;
+    std::vector<epoll_event> events(256);
+    for (int k = 0; k < handlers; ++k) {
+      router[k + 3] = [&handled, k](const epoll_event &ev) {
+        handled += ev.events + k;
+      };
+    }
+    std::minstd_rand rng(1);
+    for (epoll_event &ev : events) {
+      ev.events = EPOLLIN;
+      ev.data.fd = 3 + rng() % handlers;
+    }
+    h.run("router_dispatch", "\"handlers\":" + std::to_string(handlers), [&](uint64_t ops) {
+      for (uint64_t k = 0; k < ops; ++k) {
+        const epoll_event &ev = events[k % events.size()];
+        router[ev.data.fd](ev);
+      }
+      keep(handled);
+    });
+  }
+}
+
+// telemetry messages taken apart as handle_broadcast does, and a v2 one put
+// together as balancer-monitor does
+static void bench_telemetry(harness &h) {
+  telemetry report;
+  report.timestamp_ms = 1700000000000;
+  report.cpu = 0.25f;
+  report.mem = 0.5f;
+  char v2[telemetry::MAX_SIZE];
+  size_t v2_len = report.encode(v2);
+  char v1[telemetry::V1_SIZE] = {};
+  h.run("telemetry_decode", "\"version\":1", [&](uint64_t ops) {
+    for (uint64_t k = 0; k < ops; ++k) {
+      keep(v1);
+      telemetry decoded;
+      keep(decoded.decode(v1, sizeof(v1)));
+      keep(decoded);
+    }
+  });
+  h.run("telemetry_decode", "\"version\":2", [&](uint64_t ops) {
+    for (uint64_t k = 0; k < ops; ++k) {
+      keep(v2);
+      telemetry decoded;
+      keep(decoded.decode(v2, v2_len));
+      keep(decoded);
+    }
+  });
+  h.run("telemetry_encode", "\"version\":2", [&](uint64_t ops) {
+    for (uint64_t k = 0; k < ops; ++k) {
+      keep(report);
+      keep(report.encode(v2));
+      keep(v2);
+    }
+  });
+}
+
+// two ends of a loopback tcp connection, -1 on failure
+static int tcp_pair(int fds[2]) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listener, 1) < 0
+      || getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len) < 0) {
+    close(listener);
+    return -1;
+  }
+  fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+  int r = connect(fds[0], reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  fds[1] = r < 0 ? -1 : accept(listener, nullptr, nullptr);
+  close(listener);
+  int opt = 1;
+  for (int fd : {fds[0], fds[1]}) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  }
+  return fds[1] < 0 ? -1 : 0;
+}
+
+// one message through a channel per op, from a client socket to a backend
+// socket as pump() moves it, spliced through the pipe or copied through a buffer
+static void bench_relay(harness &h) {
+  if (!h.wanted("relay_message")) {
+    return;
+  }
+  int client[2], server[2];
+  if (tcp_pair(client) < 0 || tcp_pair(server) < 0) {
+    perror(nullptr);
+    std::cerr << "failed to connect loopback sockets, relay benchmarks skipped" << std::endl;
+    return;
+  }
+  buffer_slab buffers;
+  std::vector<char> message(buffer_slab::BUFFER_SIZE), sink(buffer_slab::BUFFER_SIZE);
+  for (size_t size : {64, 512, 4096, 16384}) {
+    for (bool buffered : {false, true}) {
+      channel ch;
+      if (ch.open() < 0) {
+        perror(nullptr);
+        return;
+      }
+      if (buffered) {
+        ch.buffer = buffers.acquire();
+      }
+      h.run("relay_message", "\"mode\":\"" + std::string(buffered ? "buffered" : "splice") + "\",\"bytes\":" + std::to_string(size), [&](uint64_t ops) {
+        for (uint64_t k = 0; k < ops; ++k) {
+          send(client[0], message.data(), size, 0);
+          for (size_t moved = 0; moved < size;) {
+            int n = ch.read(client[1]);
+            moved += n > 0 ? n : 0;
+            ch.write(server[0]);
+          }
+          for (size_t received = 0; received < size;) {
+            ssize_t n = recv(server[1], sink.data(), sink.size(), 0);
+            received += n > 0 ? n : 0;
+          }
+        }
+      });
+      ch.release_buffer(buffers);
+      ch.close();
+    }
+  }
+  for (int fd : {client[0], client[1], server[0], server[1]}) {
+    close(fd);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::string filter;
+  uint64_t min_time_ms = 20;
+  for (int opt; (opt = getopt_long(argc, argv, "", LONG_OPTIONS, nullptr)) != -1;) {
+    switch (opt) {
+    case 'f':
+      filter = optarg;
+      break;
+    case 't':
+      min_time_ms = strtoull(optarg, nullptr, 10);
+      break;
+    default:
+      std::cerr << USAGE;
+      return 1;
+    }
+  }
+  harness h(filter, min_time_ms * 1000000);
+  bench_get_server(h);
+  bench_connections(h);
+  bench_router(h);
+  bench_telemetry(h);
+  bench_relay(h);
+  return 0;
+}
@@ -8,20 +8,127 @@
 #include <ostream>
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <monitor.hpp>
 #include <cstdlib>
+#include <getopt.h>
 #include <chrono>
+#include <cmath>
+#include <algorithm>
 #include <unistd.h>
-#include "../headers/endian_convert.hpp"
+#include "../headers/telemetry.hpp"
 #include "../headers/defer.hpp"
+#include "../headers/load_sampler.hpp"
 
-static constexpr std::size_t MES_SIZE = 1 + sizeof(std::size_t) + sizeof(float) * 2;
+// shortest time between two reports, a changing load is reported this often
+static constexpr uint64_t MIN_INTERVAL_MS = 250;
+
+static const char USAGE[] = "monitor_server [options] <broadcast ip> <broadcast port> [<capacity weight> [<server ip> <server port>]]\n"
+  "the server address names the backend to a proxy with one telemetry socket for all of them\n"
+  "options:\n"
+  "  --sample <ms>\thow often the load is sampled (default 100)\n"
+  "  --smoothing <ms>\ttime constant of the moving average over the samples (default 500)\n"
+  "  --change <fraction>\treport at once when cpu, memory or a pressure moved this much (default 0.05)\n"
+  "  --max-interval <ms>\tlongest time between reports of a steady load (default 2000)\n";
+
+static const option LONG_OPTIONS[] = {
+  {"sample", required_argument, nullptr, 's'},
+  {"smoothing", required_argument, nullptr, 'a'},
+  {"change", required_argument, nullptr, 'c'},
+  {"max-interval", required_argument, nullptr, 'x'},
+  {nullptr, 0, nullptr, 0}
+};
+
+// tasks running or ready to run, the first number of the fourth field
+static uint32_t read_run_queue() {
+  uint32_t running = 0;
+  FILE *f = fopen("/proc/loadavg", "r");
+  if (f) {
+    if (fscanf(f, "%*f %*f %*f %u/", &running) != 1) {
+      running = 0;
+    }
+    fclose(f);
+  }
+  return running;
+}
+
+// bytes received and sent over all interfaces but loopback
+static int read_network_bytes(uint64_t &rx, uint64_t &tx) {
+  FILE *f = fopen("/proc/net/dev", "r");
+  if (!f) {
+    return -1;
+  }
+  rx = 0;
+  tx = 0;
+  char line[512];
+  // two header lines
+  for (int k = 0; k < 2 && fgets(line, sizeof(line), f); ++k) {
+  }
+  while (fgets(line, sizeof(line), f)) {
+    char name[64];
+    unsigned long long r, t;
+    if (sscanf(line, " %63[^:]: %llu %*u %*u %*u %*u %*u %*u %*u %llu", name, &r, &t) == 3 && strcmp(name, "lo") != 0) {
+      rx += r;
+      tx += t;
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+// tcp sockets in use on the host
+static uint32_t read_tcp_connections() {
+  uint32_t inuse = 0;
+  FILE *f = fopen("/proc/net/sockstat", "r");
+  if (f) {
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+      if (sscanf(line, "TCP: inuse %u", &inuse) == 1) {
+        break;
+      }
+    }
+    fclose(f);
+  }
+  return inuse;
+}
 
 int main (int argc, char *argv[]) {
-  if (argc < 3) {
-    std::cerr << "not enough argument" << std::endl << "monitor_server <broadcast ip> <broadcast port>" << std::endl;
+  uint64_t sample_ms = 100;
+  double smoothing_ms = 500;
+  float change = 0.05;
+  uint64_t max_interval_ms = 2000;
+  for (int opt; (opt = getopt_long(argc, argv, "+", LONG_OPTIONS, nullptr)) != -1;) {
+    switch (opt) {
+    case 's':
+      sample_ms = strtoull(optarg, nullptr, 10);
+      break;
+    case 'a':
+      smoothing_ms = atof(optarg);
+      break;
+    case 'c':
+      change = atof(optarg);
+      break;
+    case 'x':
+      max_interval_ms = strtoull(optarg, nullptr, 10);
+      break;
+    default:
+      std::cerr << USAGE;
+      return 1;
+    }
+  }
+  // positional arguments keep their historical indexes
+  argc -= optind - 1;
+  argv += optind - 1;
+  if (argc < 3 || !sample_ms) {
+    std::cerr << "not enough argument" << std::endl << USAGE;
     return 1;
   }
+  telemetry report;
+  report.capacity = argc > 3 ? atof(argv[3]) : 1;
+  // needed by a proxy with one telemetry socket for all backends when
+  // several backends run on this host
+  if (argc > 5) {
+    report.server_address = ntohl(inet_addr(argv[4]));
+    report.server_port = atoi(argv[5]);
+  }
   int broadcast_socket = socket(AF_INET, SOCK_DGRAM, 0);
   if (broadcast_socket < 0) {
     std::cerr << "failed to create socket" << std::endl;
@@ -44,41 +151,71 @@ int main (int argc, char *argv[]) {
     std::cerr << "failed to connect to broadcast address" << std::endl;
     return 1;
   }
-  std::pair<uint64_t, uint64_t> cpu0;
-  if (monitor::sample_cpu_usage(cpu0) != 0) {
+  load_sampler sampler;
+  if (sampler.init() != 0) {
     perror(nullptr);
     std::cerr << "failed to get cpu sample" << std::endl;
     return 1;
   }
-  std::this_thread::sleep_for(std::chrono::seconds(1));
+  std::cout << "cgroup " << (sampler.cgroup_path().empty() ? "none, host wide load" : sampler.cgroup_path()) << std::endl;
+  uint64_t rx0 = 0, tx0 = 0;
+  read_network_bytes(rx0, tx0);
 
+  // smoothed cpu, mem and the three pressures, and what was last reported of them
+  ewma smoothed[5];
+  float reported[5] = {};
+  auto sent_at = std::chrono::steady_clock::now();
+  auto sampled_at = sent_at;
+  // grows while the load holds still, back to the minimum once it moves
+  uint64_t interval_ms = MIN_INTERVAL_MS;
   while (true) {
-    auto current_time = std::chrono::system_clock::now();
-    uint64_t current_time_uint64 = std::chrono::duration_cast<std::chrono::seconds>(current_time.time_since_epoch()).count();
-
-    std::pair<uint64_t, uint64_t> cpu1;
-    if (monitor::sample_cpu_usage(cpu1) != 0) {
-      perror(nullptr);
-      std::cerr << "failed to get cpu sample" << std::endl;
+    std::this_thread::sleep_until(sampled_at + std::chrono::milliseconds(sample_ms));
+    auto now = std::chrono::steady_clock::now();
+    double elapsed_ms = std::chrono::duration<double, std::milli>(now - sampled_at).count();
+    sampled_at = now;
+    load_sample load = sampler.sample();
+    float samples[5] = {load.cpu, load.mem, load.cpu_pressure, load.memory_pressure, load.io_pressure};
+    bool moved = false;
+    for (int k = 0; k < 5; ++k) {
+      smoothed[k].add(samples[k], elapsed_ms, smoothing_ms);
+      moved |= std::abs(smoothed[k].value - reported[k]) >= change;
+    }
+    uint64_t since_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - sent_at).count();
+    if (since_ms < (moved ? MIN_INTERVAL_MS : interval_ms)) {
       continue;
     }
-    uint64_t cpu_total = cpu1.second - cpu0.second;
+    interval_ms = moved ? MIN_INTERVAL_MS : std::min(interval_ms * 2, std::max(max_interval_ms, MIN_INTERVAL_MS));
 
-    float cpu_usage = cpu_total == 0 ? 0 : (((double)(cpu1.first - cpu0.first)) / cpu_total);
-    float mem_usage = monitor::get_memory_usage();
-    unsigned char buf[MES_SIZE];
-    buf[0] = 0;
-    *reinterpret_cast<uint64_t*>((buf + 1)) = endian_convert::hton(current_time_uint64);
-    *reinterpret_cast<float*>((buf + 1 + sizeof(uint64_t))) = endian_convert::hton(cpu_usage);
-    *reinterpret_cast<float*>((buf + 1 + sizeof(uint64_t) + sizeof(float))) = endian_convert::hton(mem_usage);
+    uint64_t rx1 = rx0, tx1 = tx0;
+    read_network_bytes(rx1, tx1);
+    double load_average[1];
+    ++report.sequence;
+    report.timestamp_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    for (int k = 0; k < 5; ++k) {
+      reported[k] = smoothed[k].value;
+    }
+    report.cpu = reported[0];
+    report.mem = reported[1];
+    report.cpu_pressure = reported[2];
+    report.memory_pressure = reported[3];
+    report.io_pressure = reported[4];
+    report.load_average = getloadavg(load_average, 1) == 1 ? load_average[0] : 0;
+    report.run_queue = read_run_queue();
+    // counters can go back when an interface disappears
+    report.rx_rate = rx1 >= rx0 ? (rx1 - rx0) * 1000 / std::max<uint64_t>(since_ms, 1) : 0;
+    report.tx_rate = tx1 >= tx0 ? (tx1 - tx0) * 1000 / std::max<uint64_t>(since_ms, 1) : 0;
+    report.connections = read_tcp_connections();
+    rx0 = rx1;
+    tx0 = tx1;
+    sent_at = now;
+    char buf[telemetry::MAX_SIZE];
+    ssize_t len = report.encode(buf);
 
-    if (send(broadcast_socket, buf, MES_SIZE, 0) != MES_SIZE) {
+    if (send(broadcast_socket, buf, len, 0) != len) {
       perror(nullptr);
       std::cerr << "failed to sendto" << std::endl;
     }
-    cpu0 = cpu1;
-    std::cout << current_time_uint64 << "\t" << cpu_usage << "\t" << mem_usage << std::endl;
-    std::this_thread::sleep_until(current_time + std::chrono::seconds(1));
+    std::cout << report.timestamp_ms << "\t" << report.cpu << "\t" << report.mem << "\t" << report.cpu_pressure << "\t" << report.memory_pressure << "\t" << report.io_pressure << std::endl;
   }
   return 0;
 }
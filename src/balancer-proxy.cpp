@@ -1,19 +1,107 @@
 #include <arpa/inet.h>
+#include <algorithm>
 #include <atomic>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <deque>
 #include <functional>
+#include <getopt.h>
+#include <memory>
 #include <iostream>
-#include <mutex>
+#include <linux/filter.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <csignal>
 #include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unordered_map>
+#include "../headers/config.hpp"
 #include "../headers/defer.hpp"
+#include "../headers/handoff.hpp"
 #include "../headers/worker.hpp"
-#include "../headers/endian_convert.hpp"
+#include "../headers/telemetry.hpp"
 #include <thread>
 
-static constexpr size_t BC_MES_SIZE = 1 + sizeof(size_t) + sizeof(float) * 2;
+static constexpr size_t DEFAULT_PIPE_BUDGET = 256 << 20;
+static constexpr size_t DEFAULT_BUFFER_BUDGET = 64 << 20;
+static constexpr int EXPIRY_CHECK_MS = 1000;
+// how long a metrics client may take to send its request and read the reply
+static constexpr int METRICS_IO_TIMEOUT_MS = 1000;
+static constexpr int TELEMETRY_RCVBUF = 4 << 20;
+static constexpr uint32_t DEFAULT_MAX_BACKENDS = 1024;
+// events taken from the control thread's epoll per wait
+static constexpr size_t MAX_CONTROL_EVENTS = 64;
+static constexpr uint64_t DEFAULT_DRAIN_TIMEOUT_MS = 60000;
+// how long a proxy that took the listen sockets over waits for usable backends
+static constexpr uint64_t HANDOFF_READY_TIMEOUT_MS = 5000;
+// how often a process in a handoff looks whether it has backends or its last connection closed
+static constexpr int DRAIN_CHECK_MS = 100;
+
+static const char USAGE[] = "proxy_server [options] <max number of connections> <listen address> <listen port> [<server address> <server port> <server monitor address> <server monitor port>]...\n"
+  "proxy_server [options] --config <path>\n"
+  "options:\n"
+  "  --config <path>\tread the positional arguments and more options from a file, reloading its backends on SIGHUP\n"
+  "  --max-backends <n>\tdistinct backend addresses the process can take over all reloads (default 1024)\n"
+  "  --pipe-budget <bytes>\ttotal kernel pipe buffer shared by all connections (default 256MiB)\n"
+  "  --buffered-below <bytes>\trelay a direction with recv and send through a userspace buffer while its reads\n"
+  "\t\taverage less than this, instead of splicing, at most 4096, 0 always splices, epoll only (default 1024)\n"
+  "  --buffer-budget <bytes>\ttotal userspace relay buffer shared by all workers (default 64MiB)\n"
+  "  --backend <epoll|uring>\tevent loop used by the workers (default epoll)\n"
+  "  --strategy <telemetry|p2c|least-conn|wrr|maglev|peak-ewma>\thow workers pick a backend (default telemetry)\n"
+  "  --ewma-decay <ms>\ttime constant of the connect latency and error rate averages of peak-ewma (default 10000)\n"
+  "  --pool <sockets>\tconnected backend sockets kept per backend and worker, epoll only (default 0, off)\n"
+  "  --pool-idle <ms>\tage after which an unused pooled socket is closed (default 10000)\n"
+  "  --reuseport\tone SO_REUSEPORT listen socket per worker, workers pinned to cpus\n"
+  "  --fastopen <queue length>\taccept TCP fast open on the listener, needs net.ipv4.tcp_fastopen & 2\n"
+  "  --fastopen-connect\tsend bytes a client sent before its accept in the backend SYN, epoll only\n"
+  "  --defer-accept <seconds>\tonly wake workers once a client sent data\n"
+  "  --sockmap\tlet a BPF sockmap program relay established connections in the kernel, epoll only\n"
+  "  --health-interval <ms>\tactively probe every backend with a tcp connect this often (default 0, off)\n"
+  "  --eject-after <failures>\tconsecutive failed connects that eject a backend, 0 never ejects (default 3)\n"
+  "  --eject-time <ms>\thow long an ejected backend gets no connections (default 10000)\n"
+  "  --connect-timeout <ms>\ttime a backend gets to accept a connection before the next one is tried, 0 never, epoll only (default 10000)\n"
+  "  --idle-timeout <ms>\tclose connections without traffic for this long, 0 never, epoll only (default 300000)\n"
+  "  --linger-timeout <ms>\tsame for connections with one direction finished, 0 never, epoll only (default 30000)\n"
+  "  --metrics <port|path>\tserve prometheus metrics over http on a 127.0.0.1 port or a unix socket path\n"
+  "  --telemetry-listen <address> <port>\treceive the telemetry of all backends on one socket instead of one per backend,\n"
+  "\t\tthe server monitor addresses and ports are then ignored\n"
+  "  --handoff <path>\ttake the listen sockets over from the proxy listening on this unix socket, then listen\n"
+  "\t\ton it for the next one. a proxy that hands its sockets over drains its connections and exits\n"
+  "  --drain-timeout <ms>\thow long connections get to finish after a handoff before the rest are cut (default 60000)\n";
+
+static const option LONG_OPTIONS[] = {
+  {"pipe-budget", required_argument, nullptr, 'b'},
+  {"buffered-below", required_argument, nullptr, 'B'},
+  {"buffer-budget", required_argument, nullptr, 'u'},
+  {"backend", required_argument, nullptr, 'e'},
+  {"reuseport", no_argument, nullptr, 'r'},
+  {"strategy", required_argument, nullptr, 's'},
+  {"ewma-decay", required_argument, nullptr, 'E'},
+  {"fastopen", required_argument, nullptr, 'f'},
+  {"fastopen-connect", no_argument, nullptr, 'c'},
+  {"defer-accept", required_argument, nullptr, 'd'},
+  {"sockmap", no_argument, nullptr, 'k'},
+  {"health-interval", required_argument, nullptr, 'h'},
+  {"eject-after", required_argument, nullptr, 'j'},
+  {"eject-time", required_argument, nullptr, 't'},
+  {"connect-timeout", required_argument, nullptr, 'C'},
+  {"idle-timeout", required_argument, nullptr, 'I'},
+  {"linger-timeout", required_argument, nullptr, 'L'},
+  {"pool", required_argument, nullptr, 'p'},
+  {"pool-idle", required_argument, nullptr, 'i'},
+  {"metrics", required_argument, nullptr, 'm'},
+  {"telemetry-listen", required_argument, nullptr, 'T'},
+  {"config", required_argument, nullptr, 'F'},
+  {"max-backends", required_argument, nullptr, 'N'},
+  {"handoff", required_argument, nullptr, 'H'},
+  {"drain-timeout", required_argument, nullptr, 'D'},
+  {nullptr, 0, nullptr, 0}
+};
 
 int init_broadcast_listen(int ep, const char *address, uint16_t port) {
   int broadcast_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
@@ -46,13 +134,28 @@ int init_broadcast_listen(int ep, const char *address, uint16_t port) {
   return broadcast_socket;
 }
 
-int init_tcp_listen(const char *address, uint16_t port, int max_connections) {
+struct listen_options {
+  bool reuseport = false;
+  // 0 leaves the option unset
+  int fastopen = 0;
+  int defer_accept = 0;
+};
+
+int init_tcp_listen(const char *address, uint16_t port, int max_connections, const listen_options &options) {
   int listen_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (listen_socket < 0) {
     perror(nullptr);
     return listen_socket;
   }
-  
+  const int opt = 1;
+  if ((options.reuseport && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+      || (options.fastopen && setsockopt(listen_socket, IPPROTO_TCP, TCP_FASTOPEN, &options.fastopen, sizeof(options.fastopen)) < 0)
+      || (options.defer_accept && setsockopt(listen_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &options.defer_accept, sizeof(options.defer_accept)) < 0)) {
+    perror(nullptr);
+    close(listen_socket);
+    return -1;
+  }
+
   sockaddr_in listen_addr;
   listen_addr.sin_family = AF_INET;
   listen_addr.sin_addr.s_addr = inet_addr(address);
@@ -72,57 +175,721 @@ int init_tcp_listen(const char *address, uint16_t port, int max_connections) {
   return listen_socket;
 }
 
+// a unix socket when where is a path, a tcp port on the loopback otherwise
+int init_metrics_listen(const char *where) {
+  bool local = where[0] == '/';
+  int metrics_socket = socket(local ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (metrics_socket < 0) {
+    perror(nullptr);
+    return metrics_socket;
+  }
+  int bound;
+  if (local) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, where, sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+    bound = bind(metrics_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  }
+  else {
+    const int opt = 1;
+    setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(atoi(where));
+    bound = bind(metrics_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  }
+  if (bound < 0 || listen(metrics_socket, 16) < 0) {
+    perror(nullptr);
+    close(metrics_socket);
+    return -1;
+  }
+  return metrics_socket;
+}
+
+// sockets taken over were made from the previous proxy's config
+void check_listen_address(int listen_socket, const char *address, uint16_t port) {
+  sockaddr_in bound{};
+  socklen_t len = sizeof(bound);
+  if (getsockname(listen_socket, reinterpret_cast<sockaddr*>(&bound), &len) == 0
+      && (bound.sin_addr.s_addr != inet_addr(address) || ntohs(bound.sin_port) != port)) {
+    char name[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &bound.sin_addr, name, sizeof(name));
+    std::cerr << "the listen sockets taken over are bound to " << name << " " << ntohs(bound.sin_port) << ", not " << address << " " << port << std::endl;
+  }
+}
+
+// answers every request with the current metrics. runs on the control
+// thread, the timeouts bound how long a slow client can hold it up.
+void handle_metrics(const epoll_event &ev, const metrics_registry &metrics, backend_registry &registry, const connection_counters &counters) {
+  int client;
+  while ((client = accept4(ev.data.fd, nullptr, nullptr, 0)) >= 0) {
+    timeval timeout{0, METRICS_IO_TIMEOUT_MS * 1000};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // the request is read up to its end so closing does not reset the reply
+    std::string request;
+    char buf[1024];
+    ssize_t n;
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192 && (n = recv(client, buf, sizeof(buf), 0)) > 0) {
+      request.append(buf, n);
+    }
+    std::string body = metrics.render(*registry.get(), counters);
+    std::string reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    for (size_t sent = 0; sent < reply.size() && (n = send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL)) > 0;) {
+      sent += n;
+    }
+    close(client);
+  }
+}
+
+// cpus this process may run on, worker k is pinned to cpus[k % cpus.size()]
+std::vector<int> allowed_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  return cpus;
+}
+
+int pin_thread(std::thread &t, int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  errno = pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+  return errno ? -1 : 0;
+}
+
+// reuseport group program: a connection goes to the listen socket of the
+// worker pinned to the cpu that handled the SYN. sockets join the group in
+// worker order, so the returned index is the worker id. cpus without a worker
+// of their own are spread by modulo.
+int attach_cpu_steering(int listen_socket, const std::vector<int> &cpus, size_t workers) {
+  std::vector<sock_filter> code;
+  code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+  for (size_t k = 0; k < workers && k < cpus.size(); ++k) {
+    code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(cpus[k]), 0, 1));
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(k)));
+  }
+  code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(workers)));
+  code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+  sock_fprog prog = {static_cast<unsigned short>(code.size()), code.data()};
+  return setsockopt(listen_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
 void close_all(std::vector<int>& fds) {
   for (int fd : fds) {
     close(fd);
   }
 }
 
-void handle_broadcast(const epoll_event &ev, int index, std::vector<std::tuple<sockaddr_in, uint64_t, float, float>> &servers, std::shared_mutex &sm) {
-  std::unique_lock<std::shared_mutex> ul(sm);
-  char buf[BC_MES_SIZE];
-  auto &[server, timestamp, cpu, mem] = servers[index];
-  ssize_t n = recvfrom(ev.data.fd, buf, BC_MES_SIZE, 0, nullptr, nullptr);
-  if (n != BC_MES_SIZE) {
-    std::cerr << "incorrect broadcast message size" << std::endl;
-    timestamp = 0;
-    cpu = 1;
-    mem = 1;
+// datagrams for one recvmmsg call, shared by all telemetry sockets as the
+// control thread reads them one at a time
+struct telemetry_batch {
+  static constexpr unsigned SIZE = 64;
+
+  mmsghdr headers[SIZE];
+  iovec buffers[SIZE];
+  sockaddr_in sources[SIZE];
+  char data[SIZE][telemetry::MAX_SIZE];
+
+  telemetry_batch() {
+    memset(headers, 0, sizeof(headers));
+    for (unsigned k = 0; k < SIZE; ++k) {
+      buffers[k] = {data[k], sizeof(data[k])};
+      headers[k].msg_hdr.msg_iov = &buffers[k];
+      headers[k].msg_hdr.msg_iovlen = 1;
+      headers[k].msg_hdr.msg_name = &sources[k];
+    }
+  }
+
+  // number of datagrams read, 0 once the socket is drained
+  int receive(int fd) {
+    for (unsigned k = 0; k < SIZE; ++k) {
+      headers[k].msg_hdr.msg_namelen = sizeof(sources[k]);
+    }
+    int n = recvmmsg(fd, headers, SIZE, MSG_DONTWAIT, nullptr);
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror(nullptr);
+      std::cerr << "failed to receive telemetry" << std::endl;
+    }
+    return n < 0 ? 0 : n;
+  }
+
+  // the datagram as sent, nullptr when it did not fit the buffer
+  const char *message(int k, size_t &len) const {
+    len = headers[k].msg_len;
+    return headers[k].msg_hdr.msg_flags & MSG_TRUNC ? nullptr : data[k];
+  }
+};
+
+// which backend id a datagram on the shared telemetry socket is about: the
+// one named by its server field, else the only backend on the sender's address
+struct telemetry_routes {
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  std::unordered_map<uint64_t, uint32_t> servers;
+  // NONE for addresses with several backends
+  std::unordered_map<uint32_t, uint32_t> hosts;
+
+  static uint64_t key(uint32_t address, uint16_t port) {
+    return (uint64_t) address << 16 | port;
+  }
+
+  void add(const sockaddr_in &address, uint32_t id) {
+    servers[key(ntohl(address.sin_addr.s_addr), ntohs(address.sin_port))] = id;
+    auto [host, added] = hosts.emplace(ntohl(address.sin_addr.s_addr), id);
+    if (!added) {
+      host->second = NONE;
+    }
+  }
+
+  void clear() {
+    servers.clear();
+    hosts.clear();
+  }
+
+  uint32_t find(const telemetry &report, const sockaddr_in &source) const {
+    auto server = servers.find(key(report.server_address, report.server_port));
+    if (report.server_port && server != servers.end()) {
+      return server->second;
+    }
+    auto host = hosts.find(ntohl(source.sin_addr.s_addr));
+    return host == hosts.end() ? NONE : host->second;
+  }
+};
+
+// folds one report into server, false when it is older than what server has
+bool apply_telemetry(backend &server, const telemetry &report, bool valid) {
+  if (!valid) {
+    // the backend is invalid until its monitor sends something sensible
+    std::cerr << "incorrect broadcast message" << std::endl;
+    server.timestamp = 0;
+    server.sequence = 0;
+    return true;
+  }
+  // datagrams can be reordered, a v2 one that is older than the last report
+  // by both sequence and time is dropped. a restarted monitor starts a new
+  // sequence with a newer time, a stepped back clock keeps the sequence going.
+  if (report.version == 2 && server.sequence && (int32_t) (report.sequence - server.sequence) <= 0 && report.timestamp_ms <= server.timestamp) {
+    return false;
+  }
+  server.timestamp = report.timestamp_ms;
+  server.cpu = report.cpu;
+  server.mem = report.mem;
+  server.sequence = report.sequence;
+  server.capacity = report.capacity;
+  server.load_average = report.load_average;
+  server.run_queue = report.run_queue;
+  server.rx_rate = report.rx_rate;
+  server.tx_rate = report.tx_rate;
+  server.connections = report.connections;
+  server.cpu_pressure = report.cpu_pressure;
+  server.memory_pressure = report.memory_pressure;
+  server.io_pressure = report.io_pressure;
+  return true;
+}
+
+// drains an edge triggered telemetry socket and publishes one snapshot for
+// everything read. route(report, source) picks the backend id of a datagram.
+template <typename F>
+void drain_telemetry(int fd, telemetry_batch &batch, backend_registry &registry, F &&route) {
+  // copy on write, workers keep reading the previous snapshot until they pick this one up
+  backend_snapshot *next = nullptr;
+  bool changed = false;
+  int n;
+  do {
+    n = batch.receive(fd);
+    for (int k = 0; k < n; ++k) {
+      size_t len;
+      const char *buf = batch.message(k, len);
+      telemetry report;
+      bool valid = buf && report.decode(buf, len) == 0;
+      uint32_t id = route(valid ? report : telemetry{}, batch.sources[k]);
+      if (id == telemetry_routes::NONE) {
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &batch.sources[k].sin_addr, address, sizeof(address));
+        std::cerr << "telemetry from unknown backend " << address << std::endl;
+        continue;
+      }
+      if (!next) {
+        next = new backend_snapshot(*registry.get());
+      }
+      // a reload may have removed the backend since the datagram was sent
+      backend *server = next->find(id);
+      if (server) {
+        changed |= apply_telemetry(*server, report, valid);
+      }
+    }
+    // a short batch drained the socket, anything later raises a new edge
+  } while (n == (int) telemetry_batch::SIZE);
+  if (changed) {
+    registry.publish(next);
+  }
+  else {
+    delete next;
+  }
+}
+
+void handle_broadcast(const epoll_event &ev, uint32_t id, telemetry_batch &batch, backend_registry &registry) {
+  drain_telemetry(ev.data.fd, batch, registry, [id](const telemetry&, const sockaddr_in&) {
+    return id;
+  });
+}
+
+void handle_shared_telemetry(const epoll_event &ev, const telemetry_routes &routes, telemetry_batch &batch, backend_registry &registry) {
+  drain_telemetry(ev.data.fd, batch, registry, [&routes](const telemetry &report, const sockaddr_in &source) {
+    return routes.find(report, source);
+  });
+}
+
+static bool same_address(const sockaddr_in &a, const sockaddr_in &b) {
+  return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+// the configured backends and their telemetry sockets, replaced as a whole on
+// reload. an address keeps its backend id for the life of the process, so
+// connections to a removed backend keep counting against it until they
+// close, and a backend that comes back finds its health and pool state.
+class backend_set {
+  struct member {
+    sockaddr_in monitor;
+    // -1 with one telemetry socket for all backends
+    int socket = -1;
+  };
+  std::unordered_map<uint64_t, uint32_t> ids;
+  std::unordered_map<uint32_t, member> members;
+  uint32_t next_id = 0;
+  // ids available, per backend state is sized by it
+  uint32_t capacity;
+  int ep;
+  std::unordered_map<int, std::function<void(const epoll_event&)>> &router;
+  telemetry_batch &batch;
+  backend_registry &registry;
+  // null with one telemetry socket per backend
+  telemetry_routes *routes;
+
+  void close_socket(member &m) {
+    if (m.socket >= 0) {
+      router.erase(m.socket);
+      close(m.socket);
+      m.socket = -1;
+    }
+  }
+public:
+  backend_set(uint32_t capacity, int ep, std::unordered_map<int, std::function<void(const epoll_event&)>> &router, telemetry_batch &batch, backend_registry &registry, telemetry_routes *routes)
+    : capacity(capacity), ep(ep), router(router), batch(batch), registry(registry), routes(routes) {}
+  backend_set(const backend_set&) = delete;
+  backend_set& operator=(const backend_set&) = delete;
+  ~backend_set() {
+    for (auto &[id, m] : members) {
+      close_socket(m);
+    }
+  }
+
+  // publishes the configured backends, keeping the telemetry of the ones
+  // that stay. returns how many could not be added.
+  size_t update(const std::vector<backend_config> &configured) {
+    const backend_snapshot &current = *registry.get();
+    backend_snapshot *next = new backend_snapshot;
+    std::unordered_map<uint32_t, member> kept;
+    size_t skipped = 0;
+    if (routes) {
+      routes->clear();
+    }
+    for (const backend_config &server : configured) {
+      char address[INET_ADDRSTRLEN], monitor[INET_ADDRSTRLEN];
+      inet_ntop(AF_INET, &server.address.sin_addr, address, sizeof(address));
+      inet_ntop(AF_INET, &server.monitor.sin_addr, monitor, sizeof(monitor));
+      auto found = ids.find(telemetry_routes::key(ntohl(server.address.sin_addr.s_addr), ntohs(server.address.sin_port)));
+      if (found == ids.end()) {
+        if (next_id >= capacity) {
+          std::cerr << "no id left for backend " << address << " " << ntohs(server.address.sin_port) << ", raise --max-backends" << std::endl;
+          ++skipped;
+          continue;
+        }
+        found = ids.emplace(telemetry_routes::key(ntohl(server.address.sin_addr.s_addr), ntohs(server.address.sin_port)), next_id++).first;
+      }
+      uint32_t id = found->second;
+      member m;
+      auto old = members.find(id);
+      if (old != members.end()) {
+        // the socket stays open while the monitor address stays the same
+        if (same_address(old->second.monitor, server.monitor)) {
+          m = old->second;
+        }
+        else {
+          close_socket(old->second);
+        }
+        members.erase(old);
+      }
+      if (!routes && m.socket < 0) {
+        std::cout << monitor << " " << ntohs(server.monitor.sin_port) << std::endl;
+        m.socket = init_broadcast_listen(ep, monitor, ntohs(server.monitor.sin_port));
+        if (m.socket < 0) {
+          std::cerr << "failed to create broadcast_socket for " << monitor << " " << ntohs(server.monitor.sin_port) << std::endl;
+          ++skipped;
+          continue;
+        }
+        router[m.socket] = std::bind(&handle_broadcast, std::placeholders::_1, id, std::ref(batch), std::ref(registry));
+      }
+      m.monitor = server.monitor;
+      kept[id] = m;
+      if (routes) {
+        routes->add(server.address, id);
+      }
+      const backend *previous = nullptr;
+      for (const backend &b : current.backends) {
+        previous = b.id == id ? &b : previous;
+      }
+      backend entry = previous ? *previous : backend{server.address, 0, 1, 1, id};
+      entry.draining = server.drain;
+      next->backends.push_back(entry);
+    }
+    // removed backends get no new connections, the ones they have run on
+    for (auto &[id, m] : members) {
+      close_socket(m);
+    }
+    members = std::move(kept);
+    registry.publish(next);
+    return skipped;
+  }
+};
+
+// whether every option of a config file is one the command line knows
+bool known_options(const proxy_config &config) {
+  for (const std::string &word : config.options) {
+    if (word.rfind("--", 0) != 0) {
+      continue;
+    }
+    const option *o = LONG_OPTIONS;
+    while (o->name && word.compare(2, std::string::npos, o->name) != 0) {
+      ++o;
+    }
+    if (!o->name) {
+      std::cerr << "unknown option " << word.substr(2) << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// both sides of a handoff on the control thread. the sockets of the previous
+// proxy are taken over at startup, its workers keep accepting until this one
+// has usable backends and confirms. then this one listens for the next proxy,
+// and once that one confirms, stops accepting and drains.
+class listener_handoff {
+  const char *path;
+  int ep;
+  std::unordered_map<int, std::function<void(const epoll_event&)>> &router;
+  std::deque<worker> &workers;
+  const std::vector<int> &listen_sockets;
+  // false gives the metrics port up to the next proxy, true serves it again
+  std::function<void(bool)> serve_metrics;
+  int listen_socket = -1;
+  // the proxy the sockets were handed to until it confirms
+  int next = -1;
+  // the proxy the sockets came from until this one confirms
+  int previous = -1;
+  uint64_t ready_deadline_us = 0;
+  uint64_t drain_timeout_ms;
+
+  void handle_next() {
+    int peer = accept4(listen_socket, nullptr, nullptr, SOCK_CLOEXEC);
+    if (peer < 0) {
+      return;
+    }
+    if (next >= 0) {
+      std::cerr << "a handoff is already under way, refusing another" << std::endl;
+      close(peer);
+      return;
+    }
+    serve_metrics(false);
+    if (send_listeners(peer, listen_sockets) < 0 || epoll_add(ep, peer, EPOLLIN) < 0) {
+      perror(nullptr);
+      std::cerr << "failed to hand the listen sockets over, still serving" << std::endl;
+      close(peer);
+      serve_metrics(true);
+      return;
+    }
+    next = peer;
+    router[next] = std::bind(&listener_handoff::handle_confirm, this);
+  }
+
+  void handle_confirm() {
+    bool confirmed = handoff_confirmed(next);
+    // the running handler keeps its entry, a closed socket gets no more events
+    close(next);
+    next = -1;
+    if (!confirmed) {
+      std::cerr << "the next proxy went away before it was ready, still serving" << std::endl;
+      serve_metrics(true);
+      return;
+    }
+    for (worker &w : workers) {
+      w.set_mode(worker_mode::draining);
+    }
+    // the next proxy already listens at the path, it is left in place
+    router.erase(listen_socket);
+    close(listen_socket);
+    listen_socket = -1;
+    draining = true;
+    drain_deadline_us = monotonic_us() + drain_timeout_ms * 1000;
+    std::cout << "handed the listen sockets over, draining " << workers.front().counters->total() << " connections" << std::endl;
+  }
+public:
+  bool draining = false;
+  uint64_t drain_deadline_us = 0;
+
+  listener_handoff(const char *path, int ep, std::unordered_map<int, std::function<void(const epoll_event&)>> &router, std::deque<worker> &workers, const std::vector<int> &listen_sockets, std::function<void(bool)> serve_metrics, uint64_t drain_timeout_ms)
+    : path(path), ep(ep), router(router), workers(workers), listen_sockets(listen_sockets), serve_metrics(serve_metrics), drain_timeout_ms(drain_timeout_ms) {}
+  listener_handoff(const listener_handoff&) = delete;
+  listener_handoff& operator=(const listener_handoff&) = delete;
+  ~listener_handoff() {
+    for (int fd : {listen_socket, next, previous}) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  // 1 when the sockets came from a running proxy, 0 when none runs
+  int take_over(std::vector<int> &sockets) {
+    int received = receive_listeners(path, sockets, previous);
+    if (received < 0) {
+      perror(nullptr);
+      std::cerr << "failed to take the listen sockets over from " << path << std::endl;
+    }
+    else if (received) {
+      std::cout << "took over " << sockets.size() << " listen sockets from " << path << std::endl;
+      ready_deadline_us = monotonic_us() + HANDOFF_READY_TIMEOUT_MS * 1000;
+    }
+    return received;
+  }
+
+  // waiting for backends before the previous proxy is told to stop accepting
+  bool taking_over() const {
+    return previous >= 0;
+  }
+
+  bool ready(const backend_snapshot &snapshot) const {
+    return !snapshot.valid.empty() || monotonic_us() >= ready_deadline_us;
+  }
+
+  // tells the previous proxy to drain, and waits for the next one
+  int listen() {
+    if (previous >= 0 && confirm_handoff(previous) < 0) {
+      perror(nullptr);
+      std::cerr << "failed to confirm the handoff, the previous proxy keeps accepting" << std::endl;
+    }
+    previous = -1;
+    listen_socket = init_handoff_listen(path);
+    if (listen_socket < 0 || epoll_add(ep, listen_socket, EPOLLIN) < 0) {
+      perror(nullptr);
+      std::cerr << "failed to listen for a handoff on " << path << std::endl;
+      return -1;
+    }
+    router[listen_socket] = std::bind(&listener_handoff::handle_next, this);
+    return 0;
+  }
+};
+
+// reads the config file again and applies its backends. everything else in
+// it only takes effect on a restart.
+void handle_reload(const epoll_event &ev, const char *path, const proxy_config &running, backend_set &backends) {
+  signalfd_siginfo info;
+  while (read(ev.data.fd, &info, sizeof(info)) == sizeof(info)) {
+  }
+  proxy_config config;
+  if (config.load(path) < 0 || !known_options(config)) {
+    std::cerr << "failed to reload " << path << ", the running backends stay" << std::endl;
     return;
   }
-  timestamp = endian_convert::ntoh(*reinterpret_cast<size_t*>(buf + 1));
-  cpu = endian_convert::ntoh(*reinterpret_cast<float*>(buf + 1 + sizeof(size_t)));
-  mem = endian_convert::ntoh(*reinterpret_cast<float*>(buf + 1 + sizeof(size_t) + sizeof(float)));
-  std::cout << "server ID: " << index << " time: " << timestamp << " CPU: " << cpu << " mem: " << mem << std::endl;
+  if (config.options != running.options || config.listen_address != running.listen_address || config.listen_port != running.listen_port || config.max_connections != running.max_connections) {
+    std::cerr << "only backends are reloaded, the other changes in " << path << " need a restart" << std::endl;
+  }
+  size_t skipped = backends.update(config.backends);
+  std::cout << "reloaded " << path << ", " << config.backends.size() - skipped << " backends" << std::endl;
 }
 
 int main (int argc, char *argv[]) {
-  if (argc < 4 || argc % 4) {
-    std::cerr << "incorrect number of argument" << std::endl << "proxy_server <max number of connections> <listen address> <listen port> [<server address> <server port> <server monitor address> <server monitor port>]..." << std::endl;
+  // splice into a peer that reset raises SIGPIPE and, unlike send, takes no
+  // MSG_NOSIGNAL. the failed write reports EPIPE instead
+  signal(SIGPIPE, SIG_IGN);
+  size_t pipe_budget = DEFAULT_PIPE_BUDGET;
+  size_t buffer_budget = DEFAULT_BUFFER_BUDGET;
+  bool use_uring = false;
+  listen_options listening;
+  bool use_sockmap = false;
+  const char *metrics_at = nullptr;
+  const char *telemetry_address = nullptr;
+  uint16_t telemetry_port = 0;
+  const char *config_path = nullptr;
+  uint32_t max_backends = DEFAULT_MAX_BACKENDS;
+  const char *handoff_path = nullptr;
+  uint64_t drain_timeout_ms = DEFAULT_DRAIN_TIMEOUT_MS;
+  // the command line, then the options of a config file
+  auto parse_options = [&](int count, char **args) {
+    for (int opt; (opt = getopt_long(count, args, "+", LONG_OPTIONS, nullptr)) != -1;) {
+      switch (opt) {
+      case 'b':
+        pipe_budget = strtoull(optarg, nullptr, 10);
+        break;
+      case 'B':
+        channel::buffered_below = strtoull(optarg, nullptr, 10);
+        // reads fill a buffer at most, the average has to be able to reach the way back
+        if (channel::buffered_below * channel::SPLICE_FACTOR > buffer_slab::BUFFER_SIZE) {
+          std::cerr << "--buffered-below is at most " << buffer_slab::BUFFER_SIZE / channel::SPLICE_FACTOR << std::endl;
+          return -1;
+        }
+        break;
+      case 'u':
+        buffer_budget = strtoull(optarg, nullptr, 10);
+        break;
+      case 'e':
+        if (strcmp(optarg, "uring") == 0) {
+          use_uring = true;
+        }
+        else if (strcmp(optarg, "epoll") != 0) {
+          std::cerr << "unknown backend " << optarg << std::endl << USAGE;
+          return -1;
+        }
+        break;
+      case 'r':
+        listening.reuseport = true;
+        break;
+      case 'f':
+        listening.fastopen = atoi(optarg);
+        break;
+      case 'c':
+        worker::fastopen_connect = true;
+        break;
+      case 'd':
+        listening.defer_accept = atoi(optarg);
+        break;
+      case 'k':
+        use_sockmap = true;
+        break;
+      case 'h':
+        health_prober::interval_ms = strtoull(optarg, nullptr, 10);
+        break;
+      case 'j':
+        backend_health::max_failures = strtoul(optarg, nullptr, 10);
+        break;
+      case 't':
+        backend_health::eject_ms = strtoull(optarg, nullptr, 10);
+        break;
+      case 'C':
+        worker::connect_timeout_ms = strtoull(optarg, nullptr, 10);
+        break;
+      case 'I':
+        worker::idle_timeout_ms = strtoull(optarg, nullptr, 10);
+        break;
+      case 'L':
+        worker::linger_timeout_ms = strtoull(optarg, nullptr, 10);
+        break;
+      case 'p':
+        socket_pool::max_size = strtoul(optarg, nullptr, 10);
+        break;
+      case 'i':
+        socket_pool::max_idle_ms = strtoull(optarg, nullptr, 10);
+        break;
+      case 'E':
+        balancer::decay_ms = strtoull(optarg, nullptr, 10);
+        break;
+      case 'F':
+        config_path = optarg;
+        break;
+      case 'N':
+        max_backends = strtoul(optarg, nullptr, 10);
+        break;
+      case 'H':
+        handoff_path = optarg;
+        break;
+      case 'D':
+        drain_timeout_ms = strtoull(optarg, nullptr, 10);
+        break;
+      case 'm':
+        metrics_at = optarg;
+        break;
+      case 'T':
+        if (optind >= count) {
+          std::cerr << USAGE;
+          return -1;
+        }
+        telemetry_address = optarg;
+        telemetry_port = atoi(args[optind++]);
+        break;
+      case 's':
+        if (parse_strategy(optarg, balancer::mode) < 0) {
+          std::cerr << "unknown strategy " << optarg << std::endl << USAGE;
+          return -1;
+        }
+        break;
+      default:
+        std::cerr << USAGE;
+        return -1;
+      }
+    }
+    return 0;
+  };
+  if (parse_options(argc, argv) < 0) {
+    return 1;
+  }
+  proxy_config config;
+  if (config_path) {
+    if (optind != argc) {
+      std::cerr << "backends come from the config file, not the command line" << std::endl << USAGE;
+      return 1;
+    }
+    if (config.load(config_path) < 0) {
+      return 1;
+    }
+    std::vector<char*> args{argv[0]};
+    for (std::string &option : config.options) {
+      args.push_back(option.data());
+    }
+    args.push_back(nullptr);
+    // 0 makes getopt start over
+    optind = 0;
+    if (parse_options(args.size() - 1, args.data()) < 0 || optind != (int) args.size() - 1) {
+      std::cerr << "invalid option in " << config_path << std::endl;
+      return 1;
+    }
+  }
+  else {
+    // positional arguments keep their historical indexes
+    if (config.load(argc - optind + 1, argv + optind - 1) < 0) {
+      std::cerr << USAGE;
+      return 1;
+    }
+  }
+  backend_snapshot::consistent_hash = balancer::mode == strategy::maglev;
+  int max_connections = config.max_connections;
+  const char *listen_addr = config.listen_address.c_str();
+  uint16_t listen_port = config.listen_port;
+  if (config.backends.size() > max_backends) {
+    std::cerr << "more backends than --max-backends" << std::endl;
     return 1;
   }
-  int max_connections = atoi(argv[1]);
-  const char *listen_addr = argv[2];
-  uint16_t listen_port = atoi(argv[3]);
-  size_t servers_num = argc / 4 - 1;
 
   std::cout << "listening on " << listen_addr << " " << listen_port << std::endl;
-  
-  std::vector<std::tuple<sockaddr_in, size_t, float, float>> servers;
-  servers.reserve(servers_num);
 
-  std::vector<int> broadcast_sockets;
-  broadcast_sockets.reserve(servers_num);
-  
-  std::shared_mutex sm;
   std::unordered_map<int, std::function<void(const epoll_event&)>> router;
-  std::vector<worker> workers;
+  std::deque<worker> workers;
   
   auto counts = std::thread::hardware_concurrency();
-  workers.reserve(counts);
+  backend_registry registry(counts, new backend_snapshot);
   std::vector<std::thread> threads;
-  std::atomic_int number_of_connections = 0;
-  std::atomic_bool has_connections = false;
+  connection_counters counters(counts);
+  metrics_registry metrics(counts, max_backends);
 
   for (size_t k = 0; k < counts; ++k) {
     int worker_epoll_fd = epoll_create1(0);
@@ -131,7 +898,7 @@ int main (int argc, char *argv[]) {
       std::cerr << "failed to create worker epoll_fd" << std::endl;
       return 1;
     }
-    workers.emplace_back(&number_of_connections, &has_connections, worker_epoll_fd);
+    workers.emplace_back(&counters, &metrics, &registry, k, worker_epoll_fd);
   }
 
   int epoll_fd = epoll_create1(0);
@@ -142,61 +909,228 @@ int main (int argc, char *argv[]) {
   }
   defer(close(epoll_fd));
 
-  for (size_t k = 0; k < servers_num; ++k) {
-    size_t i = k + 1;
-    std::cout << argv[i*4+2] << " " << argv[i*4+3] << std::endl;
-    int broadcast_socket = init_broadcast_listen(epoll_fd, argv[i * 4 + 2], atoi(argv[i * 4 + 3]));
-    if (broadcast_socket < 0) {
-      std::cerr << "failed to create broadcast_socket for " << argv[i * 4 + 2] << " " << argv[i * 4 + 3] << std::endl;
-      continue;
+  telemetry_batch *batch = new telemetry_batch;
+  defer(delete batch);
+  telemetry_routes routes;
+  int telemetry_socket = -1;
+  if (telemetry_address) {
+    telemetry_socket = init_broadcast_listen(epoll_fd, telemetry_address, telemetry_port);
+    if (telemetry_socket < 0) {
+      std::cerr << "failed to create telemetry socket for " << telemetry_address << " " << telemetry_port << std::endl;
+      return 1;
     }
-    broadcast_sockets.push_back(broadcast_socket);
-    sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(argv[i * 4]);
-    server_addr.sin_port = htons(atoi(argv[i * 4 + 1]));
+    // room for a burst from every backend, the kernel caps it at rmem_max
+    int buffer = TELEMETRY_RCVBUF;
+    if (setsockopt(telemetry_socket, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer)) < 0) {
+      perror(nullptr);
+      std::cerr << "failed to grow the telemetry socket buffer" << std::endl;
+    }
+    router[telemetry_socket] = std::bind(&handle_shared_telemetry, std::placeholders::_1, std::cref(routes), std::ref(*batch), std::ref(registry));
+  }
+  defer(if (telemetry_socket >= 0) close(telemetry_socket));
+  backend_set backends(max_backends, epoll_fd, router, *batch, registry, telemetry_address ? &routes : nullptr);
+  backends.update(config.backends);
 
-    servers.push_back(std::make_tuple(server_addr, 0, 1, 1));
-    router[broadcast_socket] = std::bind(&handle_broadcast, std::placeholders::_1, k, std::ref(servers), std::ref(sm));
+  int reload_fd = -1;
+  if (config_path) {
+    sigset_t reload_signals;
+    sigemptyset(&reload_signals);
+    sigaddset(&reload_signals, SIGHUP);
+    // blocked before the workers start, they inherit the mask and leave the signal to the signalfd
+    reload_fd = pthread_sigmask(SIG_BLOCK, &reload_signals, nullptr) == 0 ? signalfd(-1, &reload_signals, SFD_NONBLOCK) : -1;
+    if (reload_fd < 0 || epoll_add(epoll_fd, reload_fd, EPOLLIN) < 0) {
+      perror(nullptr);
+      std::cerr << "failed to watch for SIGHUP, the config cannot be reloaded" << std::endl;
+    }
+    else {
+      router[reload_fd] = std::bind(&handle_reload, std::placeholders::_1, config_path, std::cref(config), std::ref(backends));
+    }
   }
-  defer(close_all(broadcast_sockets));
+  defer(if (reload_fd >= 0) close(reload_fd));
 
-  int listen_socket = init_tcp_listen(listen_addr, listen_port, max_connections);
-  if (listen_socket < 0) {
-    std::cerr << "failed to create listen socket" << std::endl;
+  backend_health health(max_backends);
+  health_prober prober(health);
+  balancer::health = &health;
+  if (epoll_add(epoll_fd, health.fd(), EPOLLIN) < 0 || epoll_add(epoll_fd, prober.fd(), EPOLLIN) < 0) {
+    perror(nullptr);
+    std::cerr << "failed to watch backend health" << std::endl;
+    return 1;
+  }
+  router[health.fd()] = [&health](const epoll_event&) {
+    health.drain();
+  };
+  router[prober.fd()] = [&prober](const epoll_event&) {
+    prober.handle_events();
+  };
+
+  int metrics_socket = -1;
+  defer(if (metrics_socket >= 0) close(metrics_socket));
+  auto serve_metrics = [&](bool serve) {
+    if (metrics_socket >= 0) {
+      router.erase(metrics_socket);
+      close(metrics_socket);
+      metrics_socket = -1;
+    }
+    if (!serve || !metrics_at) {
+      return 0;
+    }
+    metrics_socket = init_metrics_listen(metrics_at);
+    if (metrics_socket < 0 || epoll_add(epoll_fd, metrics_socket, EPOLLIN) < 0) {
+      std::cerr << "failed to serve metrics on " << metrics_at << std::endl;
+      return -1;
+    }
+    router[metrics_socket] = std::bind(&handle_metrics, std::placeholders::_1, std::cref(metrics), std::ref(registry), std::cref(counters));
+    return 0;
+  };
+
+  // a running proxy gives up its metrics port before it sends the sockets,
+  // so everything below binds as on a fresh start
+  std::vector<int> listen_sockets;
+  defer(close_all(listen_sockets));
+  std::unique_ptr<listener_handoff> handoff;
+  if (handoff_path) {
+    handoff = std::make_unique<listener_handoff>(handoff_path, epoll_fd, router, workers, listen_sockets, serve_metrics, drain_timeout_ms);
+    if (handoff->take_over(listen_sockets) < 0) {
+      return 1;
+    }
+    if (handoff->taking_over()) {
+      check_listen_address(listen_sockets[0], listen_addr, listen_port);
+    }
+  }
+  bool taking_over = handoff && handoff->taking_over();
+
+  if (serve_metrics(true) < 0) {
     return 1;
   }
-  defer(close(listen_socket));
 
-  epoll_event *events = new epoll_event[servers_num];
+  // a single socket shared by all workers, or one per worker in a reuseport
+  // group. sockets taken over keep the layout and options they were made with.
+  std::vector<int> cpus = allowed_cpus();
+  if (listen_sockets.empty()) {
+    for (size_t k = 0; k < (listening.reuseport ? counts : 1); ++k) {
+      int listen_socket = init_tcp_listen(listen_addr, listen_port, max_connections, listening);
+      if (listen_socket < 0) {
+        std::cerr << "failed to create listen socket" << std::endl;
+        return 1;
+      }
+      listen_sockets.push_back(listen_socket);
+    }
+    if (listening.reuseport && (cpus.empty() || attach_cpu_steering(listen_sockets[0], cpus, counts) < 0)) {
+      perror(nullptr);
+      std::cerr << "failed to attach cpu steering, connections are spread by hash" << std::endl;
+    }
+  }
+  else if (listen_sockets.size() > counts) {
+    // a closed member of a reuseport group resets the connections in its queue
+    std::cerr << "got " << listen_sockets.size() << " listen sockets for " << counts << " workers, closing the rest" << std::endl;
+    for (size_t k = counts; k < listen_sockets.size(); ++k) {
+      close(listen_sockets[k]);
+    }
+    listen_sockets.resize(counts);
+  }
+  // every worker has its own socket, the group steers connections to its cpu
+  bool own_sockets = listen_sockets.size() == counts;
+
+  // io_uring workers arm their accepts themselves
+  auto start_accepting = [&](worker &w) {
+    // an own socket has no other waiters to wake
+    uint32_t exclusive = own_sockets ? 0u : (uint32_t) EPOLLEXCLUSIVE;
+    return w.ring ? 0 : epoll_add(w.epoll_fd, listen_sockets[w.id % listen_sockets.size()], EPOLLET | EPOLLIN | exclusive, &w.listener);
+  };
+
+  size_t max_events = MAX_CONTROL_EVENTS;
+  epoll_event *events = new epoll_event[max_events];
   defer(delete[] events);
 
   for (size_t k = 0; k < counts; ++k) {
-    if (epoll_add(workers[k].epoll_fd, listen_socket, EPOLLET | EPOLLIN | EPOLLEXCLUSIVE) < 0) {
+    if (use_uring) {
+      if (workers[k].init_uring() == 0) {
+        continue;
+      }
+      perror(nullptr);
+      std::cerr << "failed to set up io_uring, worker " << k << " falls back to epoll" << std::endl;
+    }
+  }
+  for (worker &w : workers) {
+    // the previous proxy accepts until this one has backends
+    if (taking_over) {
+      w.mode = worker_mode::standby;
+    }
+    else if (start_accepting(w) < 0) {
       perror(nullptr);
       std::cerr << "failed to add listen_socket to workers' epoll" << std::endl;
       return 1;
     }
   }
+  if (handoff && !taking_over && handoff->listen() < 0) {
+    return 1;
+  }
   worker::max_connections = max_connections;
+  sockmap_relay kernel_relay;
+  if (use_sockmap) {
+    if (kernel_relay.init(max_connections) == 0) {
+      worker::kernel_relay = &kernel_relay;
+    }
+    else {
+      perror(nullptr);
+      std::cerr << "failed to set up the sockmap relay, connections are relayed through pipes" << std::endl;
+    }
+  }
+  channel::pipe_size = pipe_size_for_budget(pipe_budget, max_connections);
+  buffer_slab::max_buffers = buffer_budget / buffer_slab::BUFFER_SIZE / counts;
+  std::cout << "pipe size " << channel::pipe_size << std::endl;
 
   for (size_t k = 0; k < counts; ++k) {
-    threads.emplace_back([&workers, k, &servers, &sm, listen_socket] {
-      workers[k].run(servers.begin(), servers.end(), sm, listen_socket);
+    int listen_socket = listen_sockets[k % listen_sockets.size()];
+    threads.emplace_back([&workers, k, listen_socket] {
+      workers[k].run(listen_socket);
     });
+    if (own_sockets && counts > 1 && !cpus.empty() && pin_thread(threads.back(), cpus[k % cpus.size()]) < 0) {
+      perror(nullptr);
+      std::cerr << "failed to pin worker " << k << " to cpu " << cpus[k % cpus.size()] << std::endl;
+    }
   }
 
   while (true) {
-    int n = epoll_wait(epoll_fd, events, servers_num, -1);
+    // wakes up now and then so backends that went silent or whose ejection
+    // ended change the prepared snapshot even when no telemetry arrives
+    int timeout = health_prober::interval_ms ? std::min<uint64_t>(EXPIRY_CHECK_MS, health_prober::interval_ms) : EXPIRY_CHECK_MS;
+    timeout = handoff && (handoff->draining || handoff->taking_over()) ? std::min(timeout, DRAIN_CHECK_MS) : timeout;
+    int n = epoll_wait(epoll_fd, events, max_events, timeout);
     for (int k = 0; k < n; ++k) {
-      router[events[k].data.fd](events[k]);
+      // a reload can close a telemetry socket that has an event further on
+      auto handler = router.find(events[k].data.fd);
+      if (handler != router.end()) {
+        handler->second(events[k]);
+      }
+    }
+    prober.maintain(*registry.get());
+    backend_snapshot *next = new backend_snapshot(*registry.get());
+    if (health.apply(*next) || next->expired()) {
+      registry.publish(next);
+    }
+    else {
+      delete next;
+    }
+    if (handoff && handoff->taking_over() && handoff->ready(*registry.get())) {
+      for (worker &w : workers) {
+        if (start_accepting(w) < 0) {
+          perror(nullptr);
+          std::cerr << "failed to add listen_socket to the epoll of worker " << w.id << std::endl;
+        }
+        w.set_mode(worker_mode::serving);
+      }
+      handoff->listen();
     }
-/*    std::cout << "connections: " << number_of_connections << " ";
-    for (size_t k = 0 ; k < workers.size(); ++k) {
-      std::cout << "worker " << k << ": " << workers[k].handlers.size() << " fds" << " ";
+    if (handoff && handoff->draining && (counters.total() == 0 || monotonic_us() >= handoff->drain_deadline_us)) {
+      if (counters.total()) {
+        std::cerr << "drain timed out, cutting " << counters.total() << " connections" << std::endl;
+      }
+      for (worker &w : workers) {
+        w.set_mode(worker_mode::stopping);
+      }
+      break;
     }
-    std::cout << std::endl;
-*/    
   }
   for (auto &t : threads) {
     t.join();
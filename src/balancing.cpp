@@ -0,0 +1,232 @@
+#include "../headers/balancing.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+fast_rng::fast_rng(uint64_t seed) {
+  // splitmix64 spreads nearby seeds, the state must never be zero
+  seed += 0x9e3779b97f4a7c15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+  state = (seed ^ (seed >> 31)) | 1;
+}
+
+int parse_strategy(const char *name, strategy &out) {
+  if (strcmp(name, "telemetry") == 0) {
+    out = strategy::telemetry;
+  }
+  else if (strcmp(name, "p2c") == 0) {
+    out = strategy::p2c;
+  }
+  else if (strcmp(name, "least-conn") == 0) {
+    out = strategy::least_conn;
+  }
+  else if (strcmp(name, "wrr") == 0) {
+    out = strategy::wrr;
+  }
+  else if (strcmp(name, "maglev") == 0) {
+    out = strategy::maglev;
+  }
+  else if (strcmp(name, "peak-ewma") == 0) {
+    out = strategy::peak_ewma;
+  }
+  else {
+    return -1;
+  }
+  return 0;
+}
+
+balancer::balancer(uint64_t seed, worker_metrics *stats) : rng(seed), stats(stats), tick(rng.next()) {}
+
+void balancer::on_open(uint32_t id) {
+  if (active.size() <= id) {
+    active.resize(id + 1, 0);
+  }
+  ++active[id];
+  stats->add_backend_connection(id, 1);
+}
+
+void balancer::on_close(uint32_t id) {
+  --active[id];
+  stats->add_backend_connection(id, -1);
+}
+
+void balancer::on_connected(uint32_t id, uint64_t latency_us) {
+  stats->connects.add(1);
+  stats->connect_latency.record(latency_us);
+  observe(id, latency_us, false);
+  if (health) {
+    health->on_connected(id);
+  }
+}
+
+void balancer::on_failed(uint32_t id) {
+  stats->connect_failures.add(1);
+  observe(id, 0, true);
+  if (health) {
+    health->on_failed(id);
+  }
+}
+
+const backend *balancer::get_server(const backend_snapshot &snapshot, const sockaddr_in &client, uint32_t avoid) {
+  if (snapshot.valid.empty()) {
+    return nullptr;
+  }
+  if (active.size() < snapshot.max_id + 1) {
+    active.resize(snapshot.max_id + 1, 0);
+  }
+  const backend *picked = nullptr;
+  switch (mode) {
+  case strategy::telemetry:
+    picked = telemetry(snapshot);
+    break;
+  case strategy::p2c:
+    picked = p2c(snapshot);
+    break;
+  case strategy::least_conn:
+    picked = least_conn(snapshot);
+    break;
+  case strategy::wrr:
+    picked = wrr(snapshot);
+    break;
+  case strategy::maglev:
+    picked = maglev(snapshot, client);
+    break;
+  case strategy::peak_ewma:
+    picked = peak_ewma(snapshot);
+    break;
+  }
+  // the snapshot was prepared when it was published, a backend may have gone
+  // silent or been ejected since then
+  if (picked && usable(*picked, avoid)) {
+    return picked;
+  }
+  return any_valid(snapshot, avoid);
+}
+
+bool balancer::usable(const backend &server, uint32_t avoid) const {
+  return server.id != avoid && !server.draining && valid_timestamp(server.timestamp) && (!health || health->available(server.id));
+}
+
+// random draw weighted by the load reported by the monitors
+const backend *balancer::telemetry(const backend_snapshot &snapshot) {
+  float r = rng.uniform() * snapshot.prefix.back();
+  size_t k = std::upper_bound(snapshot.prefix.begin(), snapshot.prefix.end(), r) - snapshot.prefix.begin();
+  if (k >= snapshot.valid.size()) {
+    k = snapshot.valid.size() - 1;
+  }
+  return &snapshot.backends[snapshot.valid[k]];
+}
+
+// the less busy of two random backends, the reported load breaks ties
+const backend *balancer::p2c(const backend_snapshot &snapshot) {
+  uint32_t n = snapshot.valid.size();
+  const backend *a = &snapshot.backends[snapshot.valid[rng.below(n)]];
+  if (n == 1) {
+    return a;
+  }
+  uint32_t second = rng.below(n - 1);
+  const backend *b = &snapshot.backends[snapshot.valid[second]];
+  if (b == a) {
+    b = &snapshot.backends[snapshot.valid[n - 1]];
+  }
+  if (active[a->id] != active[b->id]) {
+    return active[a->id] < active[b->id] ? a : b;
+  }
+  return a->weight() >= b->weight() ? a : b;
+}
+
+// scans from a random offset so ties do not all land on the first backend
+const backend *balancer::least_conn(const backend_snapshot &snapshot) {
+  uint32_t n = snapshot.valid.size();
+  uint32_t start = rng.below(n);
+  const backend *best = nullptr;
+  for (uint32_t k = 0; k < n; ++k) {
+    const backend *cur = &snapshot.backends[snapshot.valid[(start + k) % n]];
+    if (!best || active[cur->id] < active[best->id]) {
+      best = cur;
+    }
+  }
+  return best;
+}
+
+const backend *balancer::wrr(const backend_snapshot &snapshot) {
+  return &snapshot.backends[snapshot.schedule[tick++ % snapshot.schedule.size()]];
+}
+
+// keyed on the client's address only, its connections come from many ports
+const backend *balancer::maglev(const backend_snapshot &snapshot, const sockaddr_in &client) {
+  if (!snapshot.maglev) {
+    return nullptr;
+  }
+  uint32_t h = client.sin_addr.s_addr;
+  h = (h ^ (h >> 16)) * 0x45d9f3b;
+  h = (h ^ (h >> 16)) * 0x45d9f3b;
+  h ^= h >> 16;
+  return &snapshot.backends[snapshot.maglev->lookup(h)];
+}
+
+// share of an average that is left after elapsed_us
+static double decay(uint64_t elapsed_us, uint64_t decay_ms) {
+  return decay_ms ? std::exp(-(double) elapsed_us / (decay_ms * 1000.0)) : 0;
+}
+
+void balancer::observe(uint32_t id, uint64_t latency_us, bool failed) {
+  if (signals.size() <= id) {
+    signals.resize(id + 1);
+  }
+  connect_signal &s = signals[id];
+  uint64_t now = monotonic_us();
+  double kept = s.updated_us ? decay(now - s.updated_us, decay_ms) : 0;
+  s.error_rate = s.error_rate * kept + (failed ? 1 - kept : 0);
+  // a refused connect fails fast, its time says nothing about the backend's load
+  if (!failed) {
+    s.latency_us = latency_us > s.latency_us ? latency_us : s.latency_us * kept + latency_us * (1 - kept);
+  }
+  s.updated_us = now;
+}
+
+// expected wait for a new connection: the connect latency times the
+// connections already in flight, raised by the failures and divided by the
+// share of the backend the monitor reports free. a backend without samples
+// costs nothing, so it gets tried, and one that has gone quiet drifts back
+// towards that.
+double balancer::cost(const backend &server, uint64_t now_us) const {
+  double latency = 0, errors = 0;
+  if (server.id < signals.size() && signals[server.id].updated_us) {
+    const connect_signal &s = signals[server.id];
+    double kept = decay(now_us > s.updated_us ? now_us - s.updated_us : 0, decay_ms);
+    latency = s.latency_us * kept;
+    errors = s.error_rate * kept;
+  }
+  float weight = server.weight();
+  return (latency + 1) * (active[server.id] + 1) * (1 + ERROR_PENALTY * errors) / (weight > 0 ? weight : 1e-3f);
+}
+
+// the cheaper of two random backends, as p2c but by cost
+const backend *balancer::peak_ewma(const backend_snapshot &snapshot) {
+  uint32_t n = snapshot.valid.size();
+  const backend *a = &snapshot.backends[snapshot.valid[rng.below(n)]];
+  if (n == 1) {
+    return a;
+  }
+  uint32_t second = rng.below(n - 1);
+  const backend *b = &snapshot.backends[snapshot.valid[second]];
+  if (b == a) {
+    b = &snapshot.backends[snapshot.valid[n - 1]];
+  }
+  uint64_t now = monotonic_us();
+  return cost(*a, now) <= cost(*b, now) ? a : b;
+}
+
+const backend *balancer::any_valid(const backend_snapshot &snapshot, uint32_t avoid) {
+  uint32_t n = snapshot.backends.size();
+  uint32_t start = rng.below(n);
+  for (uint32_t k = 0; k < n; ++k) {
+    const backend &cur = snapshot.backends[(start + k) % n];
+    if (cur.weight() > 0 && usable(cur, avoid)) {
+      return &cur;
+    }
+  }
+  return nullptr;
+}
@@ -0,0 +1,131 @@
+#include "../headers/config.hpp"
+#include <arpa/inet.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static int parse_address(const std::string &address, const std::string &port, sockaddr_in &out) {
+  out = {};
+  out.sin_family = AF_INET;
+  char *end;
+  unsigned long p = strtoul(port.c_str(), &end, 10);
+  if (inet_pton(AF_INET, address.c_str(), &out.sin_addr) != 1 || port.empty() || *end || p > UINT16_MAX) {
+    return -1;
+  }
+  out.sin_port = htons(p);
+  return 0;
+}
+
+// the backend address is its identity, it can only be listed once
+static int check_duplicates(const std::vector<backend_config> &backends) {
+  for (size_t k = 0; k < backends.size(); ++k) {
+    for (size_t j = 0; j < k; ++j) {
+      if (backends[j].address.sin_addr.s_addr == backends[k].address.sin_addr.s_addr && backends[j].address.sin_port == backends[k].address.sin_port) {
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &backends[k].address.sin_addr, address, sizeof(address));
+        std::cerr << "backend " << address << " " << ntohs(backends[k].address.sin_port) << " is listed twice" << std::endl;
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// what the service wrapper passed on the command line before config files had
+// keywords
+static int load_positional(proxy_config &config, const std::string &content) {
+  std::istringstream in(content);
+  std::vector<std::string> words{"balancer-proxy"};
+  for (std::string word; in >> word;) {
+    words.push_back(word);
+  }
+  std::vector<char*> args;
+  for (std::string &word : words) {
+    args.push_back(word.data());
+  }
+  return config.load(args.size(), args.data());
+}
+
+int proxy_config::load(const char *path) {
+  std::ifstream file(path);
+  if (!file) {
+    perror(nullptr);
+    std::cerr << "failed to open config " << path << std::endl;
+    return -1;
+  }
+  std::stringstream content;
+  content << file.rdbuf();
+  std::string first;
+  content >> first;
+  if (!first.empty() && first.find_first_not_of("0123456789") == std::string::npos) {
+    return load_positional(*this, content.str());
+  }
+  content.clear();
+  content.seekg(0);
+  *this = proxy_config{};
+  std::string line;
+  for (int number = 1; std::getline(content, line); ++number) {
+    std::istringstream in(line);
+    std::vector<std::string> words;
+    for (std::string word; in >> word;) {
+      words.push_back(word);
+    }
+    if (words.empty() || words[0][0] == '#') {
+      continue;
+    }
+    const std::string &key = words[0];
+    bool ok = true;
+    if (key == "max-connections") {
+      ok = words.size() == 2 && (max_connections = atoi(words[1].c_str())) > 0;
+    }
+    else if (key == "listen") {
+      sockaddr_in address;
+      ok = words.size() == 3 && parse_address(words[1], words[2], address) == 0;
+      if (ok) {
+        listen_address = words[1];
+        listen_port = ntohs(address.sin_port);
+      }
+    }
+    else if (key == "backend") {
+      backend_config server;
+      ok = (words.size() == 5 || (words.size() == 6 && words[5] == "drain"))
+        && parse_address(words[1], words[2], server.address) == 0
+        && parse_address(words[3], words[4], server.monitor) == 0;
+      server.drain = words.size() == 6;
+      backends.push_back(server);
+    }
+    else {
+      options.push_back("--" + key);
+      options.insert(options.end(), words.begin() + 1, words.end());
+    }
+    if (!ok) {
+      std::cerr << path << ":" << number << ": invalid line: " << line << std::endl;
+      return -1;
+    }
+  }
+  if (!max_connections || listen_address.empty()) {
+    std::cerr << path << ": max-connections and listen are required" << std::endl;
+    return -1;
+  }
+  return check_duplicates(backends);
+}
+
+int proxy_config::load(int argc, char *argv[]) {
+  if (argc < 4 || argc % 4) {
+    std::cerr << "incorrect number of argument" << std::endl;
+    return -1;
+  }
+  *this = proxy_config{};
+  max_connections = atoi(argv[1]);
+  listen_address = argv[2];
+  listen_port = atoi(argv[3]);
+  for (int i = 4; i < argc; i += 4) {
+    backend_config server;
+    if (parse_address(argv[i], argv[i + 1], server.address) < 0 || parse_address(argv[i + 2], argv[i + 3], server.monitor) < 0) {
+      std::cerr << "invalid backend " << argv[i] << " " << argv[i + 1] << " " << argv[i + 2] << " " << argv[i + 3] << std::endl;
+      return -1;
+    }
+    backends.push_back(server);
+  }
+  return check_duplicates(backends);
+}
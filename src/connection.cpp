@@ -3,98 +3,317 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-void connection::clean_up(int ep) const {
-  epoll_del(ep, server);
-  epoll_del(ep, client);
-  ::close(client);
-  ::close(server);
-  ::close(pipes[0]);
-  ::close(pipes[1]);
+char *buffer_slab::acquire() {
+  if (free_buffers.empty()) {
+    // the last chunk is cut short at the limit
+    size_t count = max_buffers - allocated < CHUNK_BUFFERS ? max_buffers - allocated : CHUNK_BUFFERS;
+    if (!count) {
+      return nullptr;
+    }
+    chunks.push_back(std::make_unique<char[]>(count * BUFFER_SIZE));
+    for (size_t k = count; k > 0; --k) {
+      free_buffers.push_back(chunks.back().get() + (k - 1) * BUFFER_SIZE);
+    }
+    allocated += count;
+  }
+  char *buffer = free_buffers.back();
+  free_buffers.pop_back();
+  return buffer;
+}
+
+void buffer_slab::release(char *buffer) {
+  free_buffers.push_back(buffer);
+}
+
+int channel::open() {
+  bytes_in_pipe = 0;
+  eof = false;
+  shut = false;
+  in_flight = false;
+  buffer_offset = 0;
+  average_read = 0;
+  buffer = nullptr;
+  if (pipe2(pipes, O_DIRECT | O_NONBLOCK) < 0) {
+    pipes[0] = -1;
+    pipes[1] = -1;
+    return -1;
+  }
+  int size = -1;
+  if (pipe_size) {
+    size = fcntl(pipes[1], F_SETPIPE_SZ, pipe_size);
+  }
+  if (size < 0) {
+    size = fcntl(pipes[1], F_GETPIPE_SZ);
+  }
+  capacity = size > 0 ? size : MIN_CHUNK;
+  chunk = MIN_CHUNK < capacity ? MIN_CHUNK : capacity;
+  return 0;
+}
+
+void channel::close() const {
+  if (pipes[0] >= 0) {
+    ::close(pipes[0]);
+    ::close(pipes[1]);
+  }
 }
 
-int connection::write(int fd) {
+int channel::write(int fd) {
   ssize_t r = 0; 
-  while(bytes_in_pipe && (r = ::splice(pipes[0], nullptr, fd, nullptr, bytes_in_pipe, SPLICE_F_NONBLOCK | SPLICE_F_MORE)) > 0) {
+  if (buffer) {
+    while (bytes_in_pipe && (r = ::send(fd, buffer + buffer_offset, bytes_in_pipe, MSG_DONTWAIT | MSG_NOSIGNAL)) > 0) {
+      bytes_in_pipe -= r;
+      buffer_offset += r;
+    }
+    if (!bytes_in_pipe) {
+      buffer_offset = 0;
+    }
+    return r;
+  }
+  while(bytes_in_pipe && (r = ::splice(pipes[0], nullptr, fd, nullptr, bytes_in_pipe, SPLICE_F_NONBLOCK)) > 0) {
     bytes_in_pipe -= r;
   }
   return r;
 }
 
-int connection::read(int fd, size_t buffer_size) {
-  ssize_t s = ::splice(fd, nullptr, pipes[1], nullptr, buffer_size, SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+int channel::read(int fd) {
+  ssize_t s;
+  if (buffer) {
+    // a destination that takes less than it is sent leaves the bytes at the end
+    if (buffer_offset + bytes_in_pipe == buffer_slab::BUFFER_SIZE) {
+      memmove(buffer, buffer + buffer_offset, bytes_in_pipe);
+      buffer_offset = 0;
+    }
+    size_t end = buffer_offset + bytes_in_pipe;
+    s = ::recv(fd, buffer + end, buffer_slab::BUFFER_SIZE - end, MSG_DONTWAIT);
+  }
+  else {
+    s = ::splice(fd, nullptr, pipes[1], nullptr, read_size(), SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+  }
   if (s < 0) {
     return s;
   }
-  bytes_in_pipe = s;
+  on_read(s);
   return s;
 }
 
-int connection::get_peer(int fd) const {
-  if (fd == client) {
-    return server;
+size_t channel::read_size() const {
+  size_t len = capacity - bytes_in_pipe;
+  return chunk < len ? chunk : len;
+}
+
+void channel::on_read(size_t s) {
+  bytes_in_pipe += s;
+  if (s) {
+    average_read = average_read ? (average_read * 7 + s) / 8 : s;
+  }
+  // a full chunk means the source keeps up, a mostly empty one means it does not
+  if (s == chunk && chunk < capacity) {
+    chunk = chunk * 2 < capacity ? chunk * 2 : capacity;
+  }
+  else if (s < chunk / 4 && chunk > MIN_CHUNK) {
+    chunk /= 2;
+  }
+}
+
+bool channel::has_room() const {
+  return (size_t) bytes_in_pipe < (buffer ? buffer_slab::BUFFER_SIZE : capacity);
+}
+
+void channel::pick_relay(buffer_slab &slab) {
+  if (bytes_in_pipe || !average_read) {
+    return;
+  }
+  if (!buffer && average_read < buffered_below) {
+    buffer = slab.acquire();
+  }
+  else if (buffer && average_read >= buffered_below * SPLICE_FACTOR) {
+    release_buffer(slab);
   }
-  else if (fd == server) {
-    return client;
+}
+
+void channel::release_buffer(buffer_slab &slab) {
+  if (buffer) {
+    slab.release(buffer);
+    buffer = nullptr;
+    buffer_offset = 0;
   }
-  return -1;
 }
 
-uint32_t *connection::get_event(int fd) {
-  if (fd == client) {
-    return &client_event;
+int connection::open(int client_fd, int server_fd) {
+  client = client_fd;
+  server = server_fd;
+  client_event = 0;
+  server_event = 0;
+  server_connected = false;
+  closing = false;
+  pending = 0;
+  client_end.state = endpoint_state::closed;
+  server_end.state = endpoint_state::closed;
+  cold.in_kernel = false;
+  cold.draining = false;
+  cold.join_attempts = 0;
+  cold.connect_attempts = 1;
+  cold.sent_in_syn = false;
+  cold.kernel_received = 0;
+  cold.timer_due = 0;
+  cold.connect_started = 0;
+  last_active = 0;
+  downstream.pipes[0] = downstream.pipes[1] = -1;
+  if (upstream.open() < 0 || downstream.open() < 0) {
+    return -1;
   }
-  else if (fd == server) {
-    return &server_event;
+  set_nodelay(client);
+  if (server < 0) {
+    server = backend_socket();
   }
-  return nullptr;
+  return server < 0 ? -1 : 0;
+}
+
+void connection::clean_up(int ep) const {
+  if (server >= 0) {
+    epoll_del(ep, server);
+    ::close(server);
+  }
+  epoll_del(ep, client);
+  ::close(client);
+  upstream.close();
+  downstream.close();
+}
+
+bool connection::finished() const {
+  return upstream.shut && downstream.shut;
+}
+
+size_t pipe_size_for_budget(size_t budget, int max_connections) {
+  if (max_connections <= 0) {
+    return 0;
+  }
+  size_t limit = 1 << 20;
+  FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+  if (f) {
+    unsigned long v;
+    if (fscanf(f, "%lu", &v) == 1) {
+      limit = v;
+    }
+    fclose(f);
+  }
+  // two pipes per connection, rounded down to a power of two number of pages
+  size_t share = budget / (2 * (size_t) max_connections);
+  size_t size = channel::MIN_CHUNK;
+  while (size * 2 <= share && size * 2 <= limit) {
+    size *= 2;
+  }
+  return size;
+}
+
+int connection::get_fd(const endpoint *end) const {
+  return end == &client_end ? client : server;
+}
+
+uint32_t *connection::get_event(const endpoint *end) {
+  return end == &client_end ? &client_event : &server_event;
+}
+
+connection_handle connection::handle() const {
+  return {cold.index, cold.generation};
 }
 
 connections_manager::connections_manager(int& ep)
   :ep(ep) {}
 
 connections_manager::~connections_manager() {
-  for (auto& conn : connections) {
-    conn.clean_up(ep);
+  for (connection *conn : by_fd) {
+    // both fds of a connection map to it, clean up once from its client
+    if (conn && conn->client >= 0 && by_fd[conn->client] == conn) {
+      conn->clean_up(ep);
+      by_fd[conn->client] = nullptr;
+    }
   }
 }
 
-void connections_manager::add(const connection& conn) {
-  size_t current_number = connections.size();
-  if (!empty_slots.empty()) {
-    current_number = empty_slots.back();
-    empty_slots.pop_back();
-    connections[current_number] = conn;
+connection* connections_manager::add(const connection& conn) {
+  if (empty_slots.empty()) {
+    uint32_t first = chunks.size() * CHUNK_SLOTS;
+    chunks.push_back(std::make_unique<connection[]>(CHUNK_SLOTS));
+    for (uint32_t k = CHUNK_SLOTS; k > 0; --k) {
+      empty_slots.push_back(first + k - 1);
+    }
   }
-  else {
-    connections.push_back(conn);
+  uint32_t index = empty_slots.back();
+  empty_slots.pop_back();
+  connection *added = slot(index);
+  uint32_t generation = added->cold.generation;
+  *added = conn;
+  added->cold.index = index;
+  added->cold.generation = generation;
+  added->client_end.conn = added;
+  added->server_end.conn = added;
+
+  size_t needed = (size_t) (conn.client > conn.server ? conn.client : conn.server) + 1;
+  if (by_fd.size() < needed) {
+    by_fd.resize(needed * 2, nullptr);
   }
-  fd_to_index[conn.server] = current_number;
-  fd_to_index[conn.client] = current_number;
+  by_fd[conn.client] = added;
+  by_fd[conn.server] = added;
+  ++live;
+  return added;
+}
+
+void connections_manager::unlink(connection &conn) {
+  conn.upstream.release_buffer(slab);
+  conn.downstream.release_buffer(slab);
+  conn.client_end.state = endpoint_state::closed;
+  conn.server_end.state = endpoint_state::closed;
+  ++conn.cold.generation;
+  by_fd[conn.client] = nullptr;
+  by_fd[conn.server] = nullptr;
+  --live;
 }
 
 void connections_manager::remove(int fd) {
-  if (fd_to_index.find(fd) == fd_to_index.end()) {
+  connection *removed_conn = get(fd);
+  if (!removed_conn) {
     return;
   }
-  size_t conn_index = fd_to_index[fd];
-  connection& removed_conn = connections[conn_index];
-  removed_conn.clean_up(ep);
-  fd_to_index.erase(removed_conn.server);
-  fd_to_index.erase(removed_conn.client);
-  empty_slots.push_back(conn_index);
+  removed_conn->clean_up(ep);
+  unlink(*removed_conn);
+  released_slots.push_back(removed_conn->cold.index);
+}
+
+void connections_manager::reclaim() {
+  empty_slots.insert(empty_slots.end(), released_slots.begin(), released_slots.end());
+  released_slots.clear();
 }
 
-connection* connections_manager::get(int fd) {
-  if (fd_to_index.find(fd) == fd_to_index.end()) {
-    return nullptr;
+// frees the slot without closing anything, the caller owns the fds
+void connections_manager::detach(int fd) {
+  connection *removed_conn = get(fd);
+  if (!removed_conn) {
+    return;
   }
-  size_t conn_index = fd_to_index.at(fd);
-  return &(connections[conn_index]);
+  unlink(*removed_conn);
+  empty_slots.push_back(removed_conn->cold.index);
+}
+
+// swaps the server socket of a live connection, the old one is closed
+void connections_manager::replace_server(connection &conn, int server_fd) {
+  epoll_del(ep, conn.server);
+  ::close(conn.server);
+  by_fd[conn.server] = nullptr;
+  conn.server = server_fd;
+  if (by_fd.size() <= (size_t) server_fd) {
+    by_fd.resize(((size_t) server_fd + 1) * 2, nullptr);
+  }
+  by_fd[server_fd] = &conn;
 }
 
 int epoll_add(int ep, int fd, uint32_t event) {
@@ -104,6 +323,13 @@ int epoll_add(int ep, int fd, uint32_t event) {
   return epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
 }
 
+int epoll_add(int ep, int fd, uint32_t event, endpoint *end) {
+  epoll_event ev;
+  ev.events = event;
+  ev.data.ptr = end;
+  return epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+}
+
 int epoll_del(int ep, int fd) {
   return epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
 }
@@ -114,3 +340,16 @@ int epoll_mod(int ep, int fd, uint32_t event) {
   ev.data.fd = fd;
   return epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev);
 }
+
+int set_nodelay(int fd) {
+  const int opt = 1;
+  return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+}
+
+int backend_socket() {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd >= 0) {
+    set_nodelay(fd);
+  }
+  return fd;
+}
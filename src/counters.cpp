@@ -0,0 +1,12 @@
+#include "../headers/counters.hpp"
+
+connection_counters::connection_counters(size_t count)
+  : shards(std::make_unique<shard[]>(count)), count(count) {}
+
+int connection_counters::total() const {
+  int sum = 0;
+  for (size_t k = 0; k < count; ++k) {
+    sum += shards[k].connections.load(std::memory_order_relaxed);
+  }
+  return sum;
+}
@@ -0,0 +1,135 @@
+#include "../headers/handoff.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// how long the new proxy waits for the running one to hand over
+static constexpr int HANDOFF_TIMEOUT_MS = 5000;
+static constexpr char HANDOFF_READY = 'R';
+
+static int unix_address(const char *path, sockaddr_un &addr) {
+  addr = {};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  return 0;
+}
+
+int receive_listeners(const char *path, std::vector<int> &fds, int &peer) {
+  sockaddr_un addr;
+  if (unix_address(path, addr) < 0) {
+    return -1;
+  }
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    return -1;
+  }
+  if (connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    int err = errno;
+    close(sock);
+    errno = err;
+    // nothing there, or a socket file left behind by a proxy that is gone
+    return err == ENOENT || err == ECONNREFUSED ? 0 : -1;
+  }
+  timeval timeout{HANDOFF_TIMEOUT_MS / 1000, HANDOFF_TIMEOUT_MS % 1000 * 1000};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  uint32_t count = 0;
+  iovec iov = {&count, sizeof(count)};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)];
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  if (n != sizeof(count)) {
+    int err = errno;
+    close(sock);
+    errno = n < 0 ? err : EPROTO;
+    return -1;
+  }
+  fds.clear();
+  for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+      size_t received = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      for (size_t k = 0; k < received; ++k) {
+        int fd;
+        memcpy(&fd, CMSG_DATA(c) + k * sizeof(int), sizeof(fd));
+        fds.push_back(fd);
+      }
+    }
+  }
+  if (fds.size() != count || msg.msg_flags & MSG_CTRUNC || fds.empty()) {
+    for (int fd : fds) {
+      close(fd);
+    }
+    fds.clear();
+    close(sock);
+    errno = EPROTO;
+    return -1;
+  }
+  peer = sock;
+  return 1;
+}
+
+int confirm_handoff(int peer) {
+  char ready = HANDOFF_READY;
+  int r = send(peer, &ready, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+  int err = errno;
+  close(peer);
+  errno = err;
+  return r;
+}
+
+bool handoff_confirmed(int peer) {
+  char ready = 0;
+  return recv(peer, &ready, 1, MSG_DONTWAIT) == 1 && ready == HANDOFF_READY;
+}
+
+int send_listeners(int fd, const std::vector<int> &fds) {
+  if (fds.empty() || fds.size() > MAX_HANDOFF_FDS) {
+    errno = EINVAL;
+    return -1;
+  }
+  uint32_t count = fds.size();
+  iovec iov = {&count, sizeof(count)};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_HANDOFF_FDS)] = {};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+  cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+  memcpy(CMSG_DATA(c), fds.data(), sizeof(int) * fds.size());
+  return sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(count) ? 0 : -1;
+}
+
+int init_handoff_listen(const char *path) {
+  sockaddr_un addr;
+  if (unix_address(path, addr) < 0) {
+    return -1;
+  }
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    return -1;
+  }
+  unlink(path);
+  if (bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+    int err = errno;
+    close(sock);
+    errno = err;
+    return -1;
+  }
+  return sock;
+}
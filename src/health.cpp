@@ -0,0 +1,162 @@
+#include "../headers/health.hpp"
+#include "../headers/connection.hpp"
+#include <cerrno>
+#include <chrono>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static constexpr int MAX_PROBE_EVENTS = 64;
+
+static uint64_t now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+backend_health::backend_health(size_t count)
+  : states(std::make_unique<backend_state[]>(count)), count(count), event_fd(eventfd(0, EFD_NONBLOCK)) {}
+
+backend_health::~backend_health() {
+  if (event_fd >= 0) {
+    close(event_fd);
+  }
+}
+
+bool backend_health::available(uint32_t id) const {
+  if (id >= count) {
+    return true;
+  }
+  const backend_state &s = states[id];
+  if (s.probe_down.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  // the clock is only read while an ejection is pending
+  uint64_t until = s.ejected_until.load(std::memory_order_relaxed);
+  return !until || now_ms() >= until;
+}
+
+void backend_health::on_connected(uint32_t id) {
+  if (id >= count) {
+    return;
+  }
+  // only written when there is something to reset, the line stays shared
+  std::atomic<uint32_t> &failures = states[id].failures;
+  if (failures.load(std::memory_order_relaxed)) {
+    failures.store(0, std::memory_order_relaxed);
+  }
+}
+
+void backend_health::on_failed(uint32_t id) {
+  if (!max_failures || id >= count) {
+    return;
+  }
+  backend_state &s = states[id];
+  if (s.failures.fetch_add(1, std::memory_order_relaxed) + 1 < max_failures) {
+    return;
+  }
+  s.failures.store(0, std::memory_order_relaxed);
+  s.ejected_until.store(now_ms() + eject_ms, std::memory_order_relaxed);
+  // wakes the control thread, which otherwise notices on its next periodic check
+  uint64_t one = 1;
+  ssize_t r = write(event_fd, &one, sizeof(one));
+  (void) r;
+}
+
+void backend_health::on_probe(uint32_t id, bool ok) {
+  if (id >= count) {
+    return;
+  }
+  backend_state &s = states[id];
+  if (ok) {
+    // reachable again, which also ends an ejection for failed connects
+    s.probe_failures = 0;
+    s.probe_down.store(false, std::memory_order_relaxed);
+    s.ejected_until.store(0, std::memory_order_relaxed);
+    s.failures.store(0, std::memory_order_relaxed);
+  }
+  else if (++s.probe_failures >= PROBE_FAILURES) {
+    s.probe_down.store(true, std::memory_order_relaxed);
+  }
+}
+
+void backend_health::drain() const {
+  uint64_t value;
+  while (read(event_fd, &value, sizeof(value)) > 0) {
+  }
+}
+
+bool backend_health::apply(backend_snapshot &snapshot) const {
+  bool changed = false;
+  for (backend &server : snapshot.backends) {
+    bool ejected = !available(server.id);
+    changed |= server.ejected != ejected;
+    server.ejected = ejected;
+  }
+  return changed;
+}
+
+health_prober::health_prober(backend_health &health)
+  : health(health), ep(epoll_create1(0)) {}
+
+health_prober::~health_prober() {
+  for (probe &p : probes) {
+    close(p.fd);
+  }
+  if (ep >= 0) {
+    close(ep);
+  }
+}
+
+void health_prober::finish(size_t k, bool ok) {
+  epoll_del(ep, probes[k].fd);
+  close(probes[k].fd);
+  health.on_probe(probes[k].id, ok);
+  probes[k] = probes.back();
+  probes.pop_back();
+}
+
+void health_prober::handle_events() {
+  epoll_event events[MAX_PROBE_EVENTS];
+  int n;
+  while ((n = epoll_wait(ep, events, MAX_PROBE_EVENTS, 0)) > 0) {
+    for (int i = 0; i < n; ++i) {
+      for (size_t k = 0; k < probes.size(); ++k) {
+        if (probes[k].fd != events[i].data.fd) {
+          continue;
+        }
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        getsockopt(probes[k].fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        finish(k, !err && !(events[i].events & (EPOLLERR | EPOLLHUP)));
+        break;
+      }
+    }
+  }
+}
+
+void health_prober::maintain(const backend_snapshot &snapshot) {
+  if (!interval_ms) {
+    return;
+  }
+  uint64_t now = now_ms();
+  if (now - last_round < interval_ms) {
+    return;
+  }
+  last_round = now;
+  while (!probes.empty()) {
+    finish(probes.size() - 1, false);
+  }
+  for (const backend &server : snapshot.backends) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+      continue;
+    }
+    int r = connect(fd, reinterpret_cast<const sockaddr*>(&server.address), sizeof(server.address));
+    if (r < 0 && errno == EINPROGRESS && epoll_add(ep, fd, EPOLLOUT) == 0) {
+      probes.push_back({fd, server.id});
+      continue;
+    }
+    close(fd);
+    health.on_probe(server.id, r == 0);
+  }
+}
@@ -0,0 +1,191 @@
+#include "../headers/load_sampler.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+static constexpr const char *PRESSURE_FILES[3] = {"cpu.pressure", "memory.pressure", "io.pressure"};
+static constexpr const char *HOST_PRESSURE_FILES[3] = {"/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io"};
+
+static uint64_t now_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// counters can go back, when a cgroup is recreated for example
+static uint64_t delta(uint64_t now, uint64_t before) {
+  return now > before ? now - before : 0;
+}
+
+static bool exists(const std::string &path) {
+  return access(path.c_str(), R_OK) == 0;
+}
+
+// value of a "<key> <number>" line, as in cpu.stat or /proc/meminfo
+static bool read_key(const std::string &path, const char *key, uint64_t &value) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  bool found = false;
+  char line[256];
+  while (!found && fgets(line, sizeof(line), f)) {
+    char name[64];
+    unsigned long long v;
+    if (sscanf(line, "%63s %llu", name, &v) == 2 && strcmp(name, key) == 0) {
+      value = v;
+      found = true;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+// a file holding a single number, false for "max" or when it is missing
+static bool read_number(const std::string &path, uint64_t &value) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  unsigned long long v;
+  bool found = fscanf(f, "%llu", &v) == 1;
+  fclose(f);
+  if (found) {
+    value = v;
+  }
+  return found;
+}
+
+// the "some" total of a pressure stall file in microseconds
+static bool read_stall(const std::string &path, uint64_t &total) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  unsigned long long v;
+  bool found = fscanf(f, "some avg10=%*f avg60=%*f avg300=%*f total=%llu", &v) == 1;
+  fclose(f);
+  if (found) {
+    total = v;
+  }
+  return found;
+}
+
+// the unified hierarchy is at the root on cgroup v2 hosts, under unified on hybrid ones
+static std::string find_cgroup() {
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (!f) {
+    return "";
+  }
+  std::string path;
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "0::", 3) == 0) {
+      path = line + 3;
+      path.erase(path.find_last_not_of("\n") + 1);
+    }
+  }
+  fclose(f);
+  if (path.empty()) {
+    return "";
+  }
+  for (const char *root : {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"}) {
+    std::string dir = std::string(root) + (path == "/" ? "" : path);
+    if (exists(std::string(root) + "/cgroup.controllers") && exists(dir + "/cgroup.procs")) {
+      return dir;
+    }
+  }
+  return "";
+}
+
+void load_sampler::read_counters(uint64_t &busy, uint64_t &total, uint64_t &usage_us, uint64_t &throttled_us, uint64_t (&stall)[3]) const {
+  FILE *f = fopen("/proc/stat", "r");
+  if (f) {
+    unsigned long long user, nice, system, idle, iowait, irq, softirq, steal;
+    if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &system, &idle, &iowait, &irq, &softirq, &steal) == 8) {
+      // guest time is already part of user time
+      total = user + nice + system + idle + iowait + irq + softirq + steal;
+      busy = total - idle - iowait;
+    }
+    fclose(f);
+  }
+  if (!cgroup.empty()) {
+    read_key(cgroup + "/cpu.stat", "usage_usec", usage_us);
+    read_key(cgroup + "/cpu.stat", "throttled_usec", throttled_us);
+  }
+  for (int k = 0; k < 3; ++k) {
+    // the cgroup's own stalls when the kernel keeps them per cgroup
+    if (cgroup.empty() || !read_stall(cgroup + "/" + PRESSURE_FILES[k], stall[k])) {
+      read_stall(HOST_PRESSURE_FILES[k], stall[k]);
+    }
+  }
+}
+
+double load_sampler::cpu_limit() const {
+  double online = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cgroup.empty()) {
+    return online;
+  }
+  FILE *f = fopen((cgroup + "/cpu.max").c_str(), "r");
+  if (!f) {
+    return online;
+  }
+  unsigned long long quota, period;
+  bool limited = fscanf(f, "%llu %llu", &quota, &period) == 2 && period;
+  fclose(f);
+  return limited && (double) quota / period < online ? (double) quota / period : online;
+}
+
+float load_sampler::memory_usage() const {
+  uint64_t total = 0, available = 0;
+  float usage = 0;
+  if (read_key("/proc/meminfo", "MemTotal:", total) && read_key("/proc/meminfo", "MemAvailable:", available) && total) {
+    usage = 1 - (double) available / total;
+  }
+  uint64_t current, limit;
+  if (!cgroup.empty() && read_number(cgroup + "/memory.current", current) && read_number(cgroup + "/memory.max", limit) && limit) {
+    float cgroup_usage = (double) current / limit;
+    usage = cgroup_usage > usage ? cgroup_usage : usage;
+  }
+  return usage;
+}
+
+int load_sampler::init() {
+  cgroup = find_cgroup();
+  last_us = now_us();
+  read_counters(host_busy, host_total, cgroup_usage_us, cgroup_throttled_us, stalls);
+  return host_total ? 0 : -1;
+}
+
+load_sample load_sampler::sample() {
+  uint64_t now = now_us();
+  uint64_t busy = host_busy, total = host_total, usage_us = cgroup_usage_us, throttled_us = cgroup_throttled_us;
+  uint64_t stall[3] = {stalls[0], stalls[1], stalls[2]};
+  read_counters(busy, total, usage_us, throttled_us, stall);
+  double elapsed_us = now > last_us ? now - last_us : 1;
+
+  load_sample load;
+  load.cpu = total > host_total ? (double) delta(busy, host_busy) / (total - host_total) : 0;
+  if (!cgroup.empty()) {
+    float share = delta(usage_us, cgroup_usage_us) / (elapsed_us * cpu_limit());
+    float throttled = delta(throttled_us, cgroup_throttled_us) / elapsed_us;
+    load.cpu = share > load.cpu ? share : load.cpu;
+    load.cpu = throttled > load.cpu ? throttled : load.cpu;
+  }
+  load.cpu = load.cpu < 1 ? load.cpu : 1;
+  load.mem = memory_usage();
+  float *pressures[3] = {&load.cpu_pressure, &load.memory_pressure, &load.io_pressure};
+  for (int k = 0; k < 3; ++k) {
+    float pressure = delta(stall[k], stalls[k]) / elapsed_us;
+    *pressures[k] = pressure < 1 ? pressure : 1;
+  }
+
+  last_us = now;
+  host_busy = busy;
+  host_total = total;
+  cgroup_usage_us = usage_us;
+  cgroup_throttled_us = throttled_us;
+  for (int k = 0; k < 3; ++k) {
+    stalls[k] = stall[k];
+  }
+  return load;
+}
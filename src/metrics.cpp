@@ -0,0 +1,165 @@
+#include "../headers/metrics.hpp"
+#include <arpa/inet.h>
+#include <sstream>
+#include <vector>
+
+uint32_t latency_histogram::bucket(uint64_t value) {
+  if (value >> MAX_BITS) {
+    return BUCKETS - 1;
+  }
+  if (value < SUB_BUCKETS) {
+    return value;
+  }
+  // the top SUB_BITS + 1 bits select the bucket within its power of two
+  uint32_t shift = 63 - __builtin_clzll(value) - SUB_BITS;
+  return shift * SUB_BUCKETS + (value >> shift);
+}
+
+uint64_t latency_histogram::upper_bound(uint32_t bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  uint32_t shift = bucket / SUB_BUCKETS - 1;
+  return ((uint64_t) (bucket - shift * SUB_BUCKETS) << shift) + ((uint64_t) 1 << shift) - 1;
+}
+
+metrics_registry::metrics_registry(size_t workers, uint32_t backends)
+  : shards(std::make_unique<worker_metrics[]>(workers)), count(workers) {
+  for (size_t k = 0; k < count; ++k) {
+    shards[k].backend_connections = std::make_unique<metric_gauge[]>(backends);
+    shards[k].backends = backends;
+  }
+}
+
+// microseconds as seconds without losing digits to a float
+static std::string seconds(uint64_t us) {
+  std::string frac = std::to_string(us % 1000000);
+  return std::to_string(us / 1000000) + "." + std::string(6 - frac.size(), '0') + frac;
+}
+
+std::string metrics_registry::render(const backend_snapshot &snapshot, const connection_counters &counters) const {
+  std::ostringstream out;
+  auto sum = [this](auto field) {
+    uint64_t total = 0;
+    for (size_t k = 0; k < count; ++k) {
+      total += field(shards[k]).get();
+    }
+    return total;
+  };
+
+  out << "# HELP balancer_accepts_total Client connections accepted.\n"
+      << "# TYPE balancer_accepts_total counter\n"
+      << "balancer_accepts_total " << sum([](const worker_metrics &m) -> auto& { return m.accepts; }) << "\n";
+  out << "# HELP balancer_backend_connects_total Backend connects by outcome.\n"
+      << "# TYPE balancer_backend_connects_total counter\n"
+      << "balancer_backend_connects_total{result=\"ok\"} " << sum([](const worker_metrics &m) -> auto& { return m.connects; }) << "\n"
+      << "balancer_backend_connects_total{result=\"failed\"} " << sum([](const worker_metrics &m) -> auto& { return m.connect_failures; }) << "\n";
+  out << "# HELP balancer_timeouts_total Connections closed by the connect, idle or linger timeout.\n"
+      << "# TYPE balancer_timeouts_total counter\n"
+      << "balancer_timeouts_total " << sum([](const worker_metrics &m) -> auto& { return m.timeouts; }) << "\n";
+
+  const char *names[2] = {"upstream", "downstream"};
+  worker_metrics::direction worker_metrics::*directions[2] = {&worker_metrics::upstream, &worker_metrics::downstream};
+  out << "# HELP balancer_relayed_bytes_total Bytes relayed through pipes by direction.\n"
+      << "# TYPE balancer_relayed_bytes_total counter\n";
+  for (int d = 0; d < 2; ++d) {
+    out << "balancer_relayed_bytes_total{direction=\"" << names[d] << "\"} "
+        << sum([&](const worker_metrics &m) -> auto& { return (m.*directions[d]).bytes; }) << "\n";
+  }
+  out << "# HELP balancer_splice_calls_total Splice calls into (read) and out of (write) the pipes.\n"
+      << "# TYPE balancer_splice_calls_total counter\n";
+  for (int d = 0; d < 2; ++d) {
+    out << "balancer_splice_calls_total{direction=\"" << names[d] << "\",op=\"read\"} "
+        << sum([&](const worker_metrics &m) -> auto& { return (m.*directions[d]).reads; }) << "\n"
+        << "balancer_splice_calls_total{direction=\"" << names[d] << "\",op=\"write\"} "
+        << sum([&](const worker_metrics &m) -> auto& { return (m.*directions[d]).writes; }) << "\n";
+  }
+  out << "# HELP balancer_splice_eagain_total Splice reads that found the source drained.\n"
+      << "# TYPE balancer_splice_eagain_total counter\n";
+  for (int d = 0; d < 2; ++d) {
+    out << "balancer_splice_eagain_total{direction=\"" << names[d] << "\"} "
+        << sum([&](const worker_metrics &m) -> auto& { return (m.*directions[d]).eagain; }) << "\n";
+  }
+
+  // buckets above the highest one in use are left out, they add nothing
+  uint64_t buckets[latency_histogram::BUCKETS] = {};
+  uint64_t latency_sum = 0;
+  uint32_t used = 0;
+  for (size_t k = 0; k < count; ++k) {
+    const latency_histogram &h = shards[k].connect_latency;
+    for (uint32_t b = 0; b < latency_histogram::BUCKETS; ++b) {
+      buckets[b] += h.count(b);
+      if (buckets[b] && b >= used) {
+        used = b + 1;
+      }
+    }
+    latency_sum += h.sum();
+  }
+  out << "# HELP balancer_backend_connect_seconds Time from starting a backend connect to its completion.\n"
+      << "# TYPE balancer_backend_connect_seconds histogram\n";
+  uint64_t cumulative = 0;
+  for (uint32_t b = 0; b < used && b + 1 < latency_histogram::BUCKETS; ++b) {
+    cumulative += buckets[b];
+    out << "balancer_backend_connect_seconds_bucket{le=\"" << seconds(latency_histogram::upper_bound(b)) << "\"} " << cumulative << "\n";
+  }
+  uint64_t total = 0;
+  for (uint64_t c : buckets) {
+    total += c;
+  }
+  out << "balancer_backend_connect_seconds_bucket{le=\"+Inf\"} " << total << "\n"
+      << "balancer_backend_connect_seconds_sum " << seconds(latency_sum) << "\n"
+      << "balancer_backend_connect_seconds_count " << total << "\n";
+
+  out << "# HELP balancer_worker_connections Open connections by worker.\n"
+      << "# TYPE balancer_worker_connections gauge\n";
+  for (size_t k = 0; k < count; ++k) {
+    out << "balancer_worker_connections{worker=\"" << k << "\"} " << counters.local(k) << "\n";
+  }
+  // what the monitors last reported, next to what the proxy itself sees
+  struct backend_gauge {
+    const char *name;
+    const char *help;
+    double (*value)(const backend&);
+  };
+  static const backend_gauge reported[] = {
+    {"balancer_backend_ejected", "Whether a backend is ejected for failing connects.", [](const backend &b) -> double { return b.ejected; }},
+    {"balancer_backend_draining", "Whether a backend is draining and gets no new connections.", [](const backend &b) -> double { return b.draining; }},
+    {"balancer_backend_cpu", "Cpu usage reported by the monitor.", [](const backend &b) -> double { return b.cpu; }},
+    {"balancer_backend_memory", "Memory usage reported by the monitor.", [](const backend &b) -> double { return b.mem; }},
+    {"balancer_backend_capacity", "Capacity weight reported by the monitor.", [](const backend &b) -> double { return b.capacity; }},
+    {"balancer_backend_load_average", "One minute load average reported by the monitor.", [](const backend &b) -> double { return b.load_average; }},
+    {"balancer_backend_run_queue", "Runnable tasks reported by the monitor.", [](const backend &b) -> double { return b.run_queue; }},
+    {"balancer_backend_receive_bytes_per_second", "Network receive rate reported by the monitor.", [](const backend &b) -> double { return b.rx_rate; }},
+    {"balancer_backend_transmit_bytes_per_second", "Network transmit rate reported by the monitor.", [](const backend &b) -> double { return b.tx_rate; }},
+    {"balancer_backend_host_connections", "Tcp sockets in use reported by the monitor.", [](const backend &b) -> double { return b.connections; }},
+    {"balancer_backend_cpu_pressure", "Share of time tasks stalled on cpu reported by the monitor.", [](const backend &b) -> double { return b.cpu_pressure; }},
+    {"balancer_backend_memory_pressure", "Share of time tasks stalled on memory reported by the monitor.", [](const backend &b) -> double { return b.memory_pressure; }},
+    {"balancer_backend_io_pressure", "Share of time tasks stalled on io reported by the monitor.", [](const backend &b) -> double { return b.io_pressure; }},
+  };
+  std::vector<std::string> labels;
+  for (const backend &server : snapshot.backends) {
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &server.address.sin_addr, address, sizeof(address));
+    labels.push_back("{backend=\"" + std::string(address) + ":" + std::to_string(ntohs(server.address.sin_port)) + "\"} ");
+  }
+  out << "# HELP balancer_backend_connections Open connections by backend.\n"
+      << "# TYPE balancer_backend_connections gauge\n";
+  for (size_t b = 0; b < snapshot.backends.size(); ++b) {
+    const backend &server = snapshot.backends[b];
+    int64_t open = 0;
+    for (size_t k = 0; k < count; ++k) {
+      if (server.id < shards[k].backends) {
+        open += shards[k].backend_connections[server.id].get();
+      }
+    }
+    out << "balancer_backend_connections" << labels[b] << open << "\n";
+  }
+  for (const backend_gauge &gauge : reported) {
+    out << "# HELP " << gauge.name << " " << gauge.help << "\n"
+        << "# TYPE " << gauge.name << " gauge\n";
+    for (size_t b = 0; b < snapshot.backends.size(); ++b) {
+      out << gauge.name << labels[b] << gauge.value(snapshot.backends[b]) << "\n";
+    }
+  }
+  return out.str();
+}
@@ -0,0 +1,185 @@
+#include "../headers/pool.hpp"
+#include "../headers/metrics.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// weight of the latest tick in the accept rate average
+static constexpr float RATE_ALPHA = 0.2f;
+// below this many accepts per second a backend keeps no sockets
+static constexpr float MIN_RATE = 0.1f;
+
+static uint64_t now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void erase(std::vector<pooled_socket*> &v, pooled_socket *s) {
+  auto it = std::find(v.begin(), v.end(), s);
+  if (it != v.end()) {
+    *it = v.back();
+    v.pop_back();
+  }
+}
+
+socket_pool::socket_pool(int &ep)
+  : ep(ep) {}
+
+socket_pool::~socket_pool() {
+  for (backend_pool &bp : pools) {
+    for (pooled_socket *s : bp.ready) {
+      release(s);
+    }
+    for (pooled_socket *s : bp.connecting) {
+      release(s);
+    }
+  }
+  reclaim();
+}
+
+void socket_pool::release(pooled_socket *s) {
+  if (s->fd >= 0) {
+    epoll_del(ep, s->fd);
+    close(s->fd);
+    s->fd = -1;
+  }
+  s->state = endpoint_state::closed;
+  released.push_back(s);
+}
+
+void socket_pool::reclaim() {
+  for (pooled_socket *s : released) {
+    delete s;
+  }
+  released.clear();
+}
+
+int socket_pool::open(const backend &server) {
+  int fd = backend_socket();
+  if (fd < 0) {
+    return -1;
+  }
+  uint64_t started = monotonic_us();
+  if (connect(fd, reinterpret_cast<const sockaddr*>(&server.address), sizeof(server.address)) < 0 && errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  pooled_socket *s = new pooled_socket;
+  s->conn = nullptr;
+  s->state = endpoint_state::pool_connecting;
+  s->fd = fd;
+  s->backend = server.id;
+  s->since = 0;
+  s->connect_us = started;
+  if (epoll_add(ep, fd, EPOLLOUT | EPOLLRDHUP | EPOLLIN | EPOLLET, s) < 0) {
+    close(fd);
+    delete s;
+    return -1;
+  }
+  pools[server.id].connecting.push_back(s);
+  return 0;
+}
+
+int socket_pool::take(uint32_t id, uint64_t &latency_us) {
+  if (!max_size || id >= pools.size()) {
+    return -1;
+  }
+  backend_pool &bp = pools[id];
+  ++bp.accepts;
+  while (!bp.ready.empty()) {
+    // the most recently connected socket is the least likely to be timed out
+    pooled_socket *s = bp.ready.back();
+    bp.ready.pop_back();
+    int fd = s->fd;
+    latency_us = s->connect_us;
+    epoll_del(ep, fd);
+    s->fd = -1;
+    release(s);
+    // the backend may have closed it after its last event was handled
+    char c;
+    ssize_t r = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (r > 0 || (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+      return fd;
+    }
+    close(fd);
+  }
+  return -1;
+}
+
+void socket_pool::handle_event(pooled_socket *s, uint32_t events) {
+  backend_pool &bp = pools[s->backend];
+  if (s->state == endpoint_state::pool_connecting) {
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+    if (err == EINPROGRESS) {
+      return;
+    }
+    erase(bp.connecting, s);
+    if (err || events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP) || !bp.valid) {
+      release(s);
+      return;
+    }
+    s->state = endpoint_state::pool_idle;
+    s->since = now_ms();
+    s->connect_us = monotonic_us() - s->connect_us;
+    bp.ready.push_back(s);
+    return;
+  }
+  // bytes a backend sends first stay queued for the client, only a close or
+  // an error makes the socket useless
+  if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+    auto it = std::find(bp.ready.begin(), bp.ready.end(), s);
+    if (it != bp.ready.end()) {
+      bp.ready.erase(it);
+    }
+    release(s);
+  }
+}
+
+void socket_pool::maintain(const backend_snapshot &snapshot) {
+  if (!max_size) {
+    return;
+  }
+  uint64_t now = now_ms();
+  if (now - last_tick < TICK_MS) {
+    return;
+  }
+  uint64_t elapsed = last_tick ? now - last_tick : TICK_MS;
+  last_tick = now;
+  if (pools.size() < snapshot.max_id + 1) {
+    pools.resize(snapshot.max_id + 1);
+  }
+  for (backend_pool &bp : pools) {
+    bp.valid = false;
+  }
+  for (uint32_t k : snapshot.valid) {
+    const backend &server = snapshot.backends[k];
+    backend_pool &bp = pools[server.id];
+    bp.valid = true;
+    bp.rate = RATE_ALPHA * (bp.accepts * 1000.0f / elapsed) + (1 - RATE_ALPHA) * bp.rate;
+    bp.accepts = 0;
+    size_t target = bp.rate < MIN_RATE ? 0 : std::min<size_t>(max_size, std::ceil(bp.rate * HORIZON));
+    // oldest first, whatever idled too long or is more than needed
+    while (!bp.ready.empty() && (bp.ready.size() > target || now - bp.ready.front()->since > max_idle_ms)) {
+      release(bp.ready.front());
+      bp.ready.pop_front();
+    }
+    while (bp.ready.size() + bp.connecting.size() < target && open(server) == 0) {
+    }
+  }
+  for (backend_pool &bp : pools) {
+    if (bp.valid) {
+      continue;
+    }
+    for (pooled_socket *s : bp.ready) {
+      release(s);
+    }
+    bp.ready.clear();
+    bp.rate = 0;
+    bp.accepts = 0;
+  }
+}
@@ -0,0 +1,222 @@
+#include "../headers/sockmap.hpp"
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int bpf(int cmd, bpf_attr &attr) {
+  return syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+}
+
+static bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+  bpf_insn i;
+  i.code = code;
+  i.dst_reg = dst;
+  i.src_reg = src;
+  i.off = off;
+  i.imm = imm;
+  return i;
+}
+
+static int create_map(uint32_t type, uint32_t key_size, uint32_t value_size, uint32_t max_entries) {
+  bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = type;
+  attr.key_size = key_size;
+  attr.value_size = value_size;
+  attr.max_entries = max_entries;
+  return bpf(BPF_MAP_CREATE, attr);
+}
+
+static int update_elem(int map_fd, const void *key, const void *value) {
+  bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = reinterpret_cast<uint64_t>(key);
+  attr.value = reinterpret_cast<uint64_t>(value);
+  attr.flags = BPF_ANY;
+  return bpf(BPF_MAP_UPDATE_ELEM, attr);
+}
+
+static int delete_elem(int map_fd, const void *key) {
+  bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = map_fd;
+  attr.key = reinterpret_cast<uint64_t>(key);
+  return bpf(BPF_MAP_DELETE_ELEM, attr);
+}
+
+static int load_program(const bpf_insn *code, uint32_t count, char *log, uint32_t log_size) {
+  static const char LICENSE[] = "MIT";
+  bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+  attr.insns = reinterpret_cast<uint64_t>(code);
+  attr.insn_cnt = count;
+  attr.license = reinterpret_cast<uint64_t>(LICENSE);
+  if (log) {
+    attr.log_buf = reinterpret_cast<uint64_t>(log);
+    attr.log_size = log_size;
+    attr.log_level = 1;
+  }
+  return bpf(BPF_PROG_LOAD, attr);
+}
+
+sockmap_relay::~sockmap_relay() {
+  for (int fd : {prog_fd, sockets_fd, targets_fd, peers_fd}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+int sockmap_relay::init(uint32_t max_connections) {
+  uint32_t entries = max_connections ? 2 * max_connections : 2;
+  sockets_fd = create_map(BPF_MAP_TYPE_SOCKHASH, sizeof(uint64_t), sizeof(uint32_t), entries);
+  targets_fd = create_map(BPF_MAP_TYPE_SOCKHASH, sizeof(uint64_t), sizeof(uint32_t), entries);
+  peers_fd = create_map(BPF_MAP_TYPE_HASH, sizeof(uint64_t), sizeof(uint64_t), entries);
+  if (sockets_fd < 0 || targets_fd < 0 || peers_fd < 0) {
+    return -1;
+  }
+  // r6 = ctx
+  // if ctx->len == 0 return SK_PASS
+  // *(u64 *)(r10 - 8) = get_socket_cookie(ctx)
+  // r0 = map_lookup_elem(peers, r10 - 8)
+  // if r0 == 0 return SK_PASS
+  // *(u64 *)(r10 - 16) = *(u64 *)r0
+  // return sk_redirect_hash(ctx, targets, r10 - 16, 0)
+  const bpf_insn code[] = {
+    insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+    // a bare FIN has no bytes, sending it on would fail the peer with EPIPE.
+    // passed, it ends the stream of the socket that received it
+    insn(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(__sk_buff, len), 0),
+    insn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_2, 0, 18, 0),
+    insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+    insn(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+    insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, peers_fd),
+    insn(0, 0, 0, 0, 0),
+    insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0),
+    insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, -8),
+    insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+    insn(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 10, 0),
+    insn(BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0, 0, 0),
+    insn(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_1, -16, 0),
+    insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+    insn(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, targets_fd),
+    insn(0, 0, 0, 0, 0),
+    insn(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+    insn(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -16),
+    insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+    insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+    insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    insn(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+    insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+  };
+  uint32_t count = sizeof(code) / sizeof(code[0]);
+  prog_fd = load_program(code, count, nullptr, 0);
+  if (prog_fd < 0) {
+    int err = errno;
+    // load again only to get the verifier's explanation
+    static char log[16384];
+    if (load_program(code, count, log, sizeof(log)) < 0 && log[0]) {
+      std::cerr << log << std::endl;
+    }
+    errno = err;
+    return -1;
+  }
+  bpf_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.target_fd = sockets_fd;
+  attr.attach_bpf_fd = prog_fd;
+  attr.attach_type = BPF_SK_SKB_STREAM_VERDICT;
+  return bpf(BPF_PROG_ATTACH, attr);
+}
+
+int sockmap_relay::join(int a, int b, uint64_t cookies[2]) {
+  int fds[2] = {a, b};
+  for (int k = 0; k < 2; ++k) {
+    socklen_t len = sizeof(cookies[k]);
+    if (getsockopt(fds[k], SOL_SOCKET, SO_COOKIE, &cookies[k], &len) < 0) {
+      return -1;
+    }
+  }
+  // both must be reachable before either runs the program, or what reaches
+  // the first one to join would be dropped
+  for (int k = 0; k < 2; ++k) {
+    uint32_t fd = fds[k];
+    if (update_elem(targets_fd, &cookies[k], &fd) < 0) {
+      leave(cookies);
+      return -1;
+    }
+  }
+  if (update_elem(peers_fd, &cookies[0], &cookies[1]) < 0 || update_elem(peers_fd, &cookies[1], &cookies[0]) < 0) {
+    leave(cookies);
+    return -1;
+  }
+  for (int k = 0; k < 2; ++k) {
+    uint32_t fd = fds[k];
+    if (update_elem(sockets_fd, &cookies[k], &fd) < 0) {
+      leave(cookies);
+      return -1;
+    }
+  }
+  // the program only sees bytes as they arrive. setting the low watermark
+  // signals the socket as readable, which hands it whatever came in before
+  // it joined
+  for (int k = 0; k < 2; ++k) {
+    int lowat = 1;
+    if (setsockopt(fds[k], SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat)) < 0) {
+      leave(cookies);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void sockmap_relay::leave(const uint64_t cookies[2]) {
+  for (int k = 0; k < 2; ++k) {
+    delete_elem(sockets_fd, &cookies[k]);
+    delete_elem(targets_fd, &cookies[k]);
+    delete_elem(peers_fd, &cookies[k]);
+  }
+}
+
+uint64_t sockmap_relay::received(int fd) {
+  tcp_info info;
+  socklen_t len = sizeof(info);
+  memset(&info, 0, sizeof(info));
+  getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+  return info.tcpi_bytes_received;
+}
+
+uint64_t sockmap_relay::consumed(int fd) {
+  // the two counts come from separate calls, retry until no bytes arrived
+  // in between
+  while (true) {
+    uint64_t before = received(fd);
+    int pending = 0;
+    if (ioctl(fd, SIOCINQ, &pending) < 0) {
+      return before;
+    }
+    if (received(fd) == before) {
+      return before - pending;
+    }
+  }
+}
+
+uint64_t sockmap_relay::queued(int fd) {
+  tcp_info info;
+  socklen_t len = sizeof(info);
+  memset(&info, 0, sizeof(info));
+  getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+  // first transmissions plus what still waits in the write queue
+  return info.tcpi_bytes_sent - info.tcpi_bytes_retrans + info.tcpi_notsent_bytes;
+}
@@ -0,0 +1,115 @@
+#include "../headers/telemetry.hpp"
+#include "../headers/endian_convert.hpp"
+#include <cstring>
+
+// the message has no alignment, every value goes through memcpy
+template <typename T>
+static T load(const char *p) {
+  T v;
+  memcpy(&v, p, sizeof(v));
+  return endian_convert::ntoh(v);
+}
+
+template <typename T>
+static char *store(char *p, T v) {
+  v = endian_convert::hton(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+template <typename T>
+static char *store_field(char *p, telemetry_field type, T v) {
+  *p++ = type;
+  *p++ = sizeof(v);
+  return store(p, v);
+}
+
+int telemetry::decode(const char *buf, size_t len) {
+  if (len == V1_SIZE && buf[0] == 0) {
+    version = 1;
+    timestamp_ms = load<uint64_t>(buf + 1) * 1000;
+    cpu = load<float>(buf + 1 + sizeof(uint64_t));
+    mem = load<float>(buf + 1 + sizeof(uint64_t) + sizeof(float));
+    return 0;
+  }
+  if (len < V2_HEADER_SIZE || buf[0] != 2) {
+    return -1;
+  }
+  version = 2;
+  sequence = load<uint32_t>(buf + 1);
+  timestamp_ms = load<uint64_t>(buf + 1 + sizeof(uint32_t));
+  const char *p = buf + V2_HEADER_SIZE;
+  const char *end = buf + len;
+  while (p < end) {
+    if (end - p < 2 || end - p - 2 < (uint8_t) p[1]) {
+      return -1;
+    }
+    uint8_t type = p[0];
+    uint8_t size = p[1];
+    const char *value = p + 2;
+    p = value + size;
+    if (size == sizeof(float) && type == TELEMETRY_CPU) {
+      cpu = load<float>(value);
+    }
+    else if (size == sizeof(float) && type == TELEMETRY_MEM) {
+      mem = load<float>(value);
+    }
+    else if (size == sizeof(float) && type == TELEMETRY_LOAD_AVERAGE) {
+      load_average = load<float>(value);
+    }
+    else if (size == sizeof(uint32_t) && type == TELEMETRY_RUN_QUEUE) {
+      run_queue = load<uint32_t>(value);
+    }
+    else if (size == sizeof(uint64_t) && type == TELEMETRY_RX_RATE) {
+      rx_rate = load<uint64_t>(value);
+    }
+    else if (size == sizeof(uint64_t) && type == TELEMETRY_TX_RATE) {
+      tx_rate = load<uint64_t>(value);
+    }
+    else if (size == sizeof(uint32_t) && type == TELEMETRY_CONNECTIONS) {
+      connections = load<uint32_t>(value);
+    }
+    else if (size == sizeof(float) && type == TELEMETRY_CAPACITY) {
+      capacity = load<float>(value);
+    }
+    else if (size == sizeof(float) && type == TELEMETRY_CPU_PRESSURE) {
+      cpu_pressure = load<float>(value);
+    }
+    else if (size == sizeof(float) && type == TELEMETRY_MEMORY_PRESSURE) {
+      memory_pressure = load<float>(value);
+    }
+    else if (size == sizeof(float) && type == TELEMETRY_IO_PRESSURE) {
+      io_pressure = load<float>(value);
+    }
+    else if (size == sizeof(uint32_t) + sizeof(uint16_t) && type == TELEMETRY_SERVER) {
+      server_address = load<uint32_t>(value);
+      server_port = load<uint16_t>(value + sizeof(uint32_t));
+    }
+  }
+  return 0;
+}
+
+size_t telemetry::encode(char *buf) const {
+  char *p = buf;
+  *p++ = 2;
+  p = store(p, sequence);
+  p = store(p, timestamp_ms);
+  p = store_field(p, TELEMETRY_CPU, cpu);
+  p = store_field(p, TELEMETRY_MEM, mem);
+  p = store_field(p, TELEMETRY_LOAD_AVERAGE, load_average);
+  p = store_field(p, TELEMETRY_RUN_QUEUE, run_queue);
+  p = store_field(p, TELEMETRY_RX_RATE, rx_rate);
+  p = store_field(p, TELEMETRY_TX_RATE, tx_rate);
+  p = store_field(p, TELEMETRY_CONNECTIONS, connections);
+  p = store_field(p, TELEMETRY_CAPACITY, capacity);
+  p = store_field(p, TELEMETRY_CPU_PRESSURE, cpu_pressure);
+  p = store_field(p, TELEMETRY_MEMORY_PRESSURE, memory_pressure);
+  p = store_field(p, TELEMETRY_IO_PRESSURE, io_pressure);
+  if (server_port) {
+    *p++ = TELEMETRY_SERVER;
+    *p++ = sizeof(server_address) + sizeof(server_port);
+    p = store(p, server_address);
+    p = store(p, server_port);
+  }
+  return p - buf;
+}
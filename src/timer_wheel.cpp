@@ -0,0 +1,24 @@
+#include "../headers/timer_wheel.hpp"
+
+uint64_t timer_wheel::schedule(connection_handle handle, uint64_t expires) {
+  if (expires <= current) {
+    expires = current + 1;
+  }
+  else if (expires - current >= RANGE) {
+    expires = current + RANGE - 1;
+  }
+  place({handle, expires});
+  ++count;
+  return expires;
+}
+
+// the level is chosen by the highest bit in which expires differs from the
+// current tick, so an entry is cascaded down exactly when its slot comes up
+void timer_wheel::place(const entry &e) {
+  uint64_t differs = e.expires ^ current;
+  uint32_t level = 0;
+  while (level + 1 < LEVELS && differs >> (SLOT_BITS * (level + 1))) {
+    ++level;
+  }
+  slots[level][(e.expires >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(e);
+}
@@ -0,0 +1,108 @@
+#include "../headers/uring.hpp"
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int io_uring_setup(unsigned entries, io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+uring::~uring() {
+  if (sqes) {
+    munmap(sqes, sqes_len);
+  }
+  if (cq_ptr && cq_ptr != sq_ptr) {
+    munmap(cq_ptr, cq_len);
+  }
+  if (sq_ptr) {
+    munmap(sq_ptr, sq_len);
+  }
+  if (ring_fd >= 0) {
+    close(ring_fd);
+  }
+}
+
+int uring::init(unsigned entries) {
+  io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 4;
+  ring_fd = io_uring_setup(entries, &p);
+  if (ring_fd < 0 && errno == EINVAL) {
+    memset(&p, 0, sizeof(p));
+    ring_fd = io_uring_setup(entries, &p);
+  }
+  if (ring_fd < 0) {
+    return -1;
+  }
+  if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    errno = ENOSYS;
+    return -1;
+  }
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  if (cq_len > sq_len) {
+    sq_len = cq_len;
+  }
+  sq_ptr = mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) {
+    sq_ptr = nullptr;
+    return -1;
+  }
+  cq_ptr = sq_ptr;
+  sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+  void *s = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (s == MAP_FAILED) {
+    return -1;
+  }
+  sqes = static_cast<io_uring_sqe*>(s);
+
+  char *sq = static_cast<char*>(sq_ptr);
+  sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  sq_entries = p.sq_entries;
+  char *cq = static_cast<char*>(cq_ptr);
+  cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+  return 0;
+}
+
+io_uring_sqe *uring::get_sqe() {
+  std::atomic_ref<unsigned> head(*sq_head);
+  unsigned tail = *sq_tail;
+  if (tail - head.load(std::memory_order_acquire) >= sq_entries) {
+    // the queue is full, hand what we have to the kernel first
+    if (submit_and_wait(0) < 0) {
+      return nullptr;
+    }
+    tail = *sq_tail;
+  }
+  unsigned index = tail & *sq_mask;
+  io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  std::atomic_ref<unsigned>(*sq_tail).store(tail + 1, std::memory_order_release);
+  ++to_submit;
+  return sqe;
+}
+
+int uring::submit_and_wait(unsigned wait_nr) {
+  int r;
+  do {
+    r = io_uring_enter(ring_fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+  } while (r < 0 && errno == EINTR);
+  if (r >= 0) {
+    to_submit -= (unsigned) r < to_submit ? r : to_submit;
+  }
+  return r;
+}
@@ -3,374 +3,593 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
-#include <functional>
 #include <iostream>
 #include <fcntl.h>
 #include <cstring>
+#include <netinet/tcp.h>
 #include <chrono>
 #include <ostream>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
-#include <unordered_map>
 
-worker::worker(std::atomic_int *number_of_connections, std::atomic_bool *has_connections, int epoll_fd) : number_of_connections(number_of_connections), has_connections(has_connections), connections(epoll_fd), epoll_fd(epoll_fd) {}
+static uint64_t now_tick() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() / worker::TIMER_TICK_MS;
+}
 
-worker::~worker() {
-  close(epoll_fd);
+worker::worker(connection_counters *counters, metrics_registry *metrics, backend_registry *backends, size_t id, int epoll_fd) : counters(counters), stats(&metrics->shard(id)), backends(backends), id(id), connections(epoll_fd), balance(std::chrono::steady_clock::now().time_since_epoch().count() + id, stats), pool(epoll_fd), epoll_fd(epoll_fd), timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)), wake_fd(eventfd(0, EFD_NONBLOCK)) {
+  timers.start(now_tick());
+  if (timer_fd < 0 || epoll_add(epoll_fd, timer_fd, EPOLLIN, &timer_end) < 0) {
+    perror(nullptr);
+    std::cerr << "failed to set up the timer of worker " << id << ", connections never time out" << std::endl;
+  }
+  if (wake_fd < 0 || epoll_add(epoll_fd, wake_fd, EPOLLIN, &wake_end) < 0) {
+    perror(nullptr);
+    std::cerr << "failed to set up the wake up of worker " << id << ", it cannot be drained" << std::endl;
+  }
 }
 
-static size_t get_buffer_size(int number_of_connections) {
-  return 1 + (1023 / (number_of_connections / 1024 + 1));
+worker::~worker() {
+  if (timer_fd >= 0) {
+    close(timer_fd);
+  }
+  if (wake_fd >= 0) {
+    close(wake_fd);
+  }
+  close(epoll_fd);
 }
 
-static void write_to(std::unordered_map<int, std::function<void(const epoll_event&)>> &handlers, connections_manager &connections, std::atomic_int *number_of_connections, connection *conn, int fd, int peer, uint32_t *fd_events, uint32_t *peer_events) {
-  while (*fd_events & EPOLLOUT && conn->bytes_in_pipe && conn->des == fd) {
-    int n = conn->write(fd);
-    if (n < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        *fd_events ^= EPOLLOUT;
-      }
-      else {
-        perror(nullptr);
-        std::cerr << "failed to splice server: " << conn->server << " client: " << conn->client << " fd: " << fd << std::endl;
-        handlers.erase(conn->client);
-        handlers.erase(conn->server);
-        connections.remove(fd);
-        (*number_of_connections)--;
-        return;
-      }
-    }
-    //std::cout << "write " << n << " to " << fd << std::endl;
-/*    if (n == 0) {
-      std::cerr << "write 0 to " << fd << std::endl;
-      handlers.erase(conn->client);
-      handlers.erase(conn->server);
-      connections.remove(fd);
-      (*number_of_connections)--;
-    }*/
-    if (conn->bytes_in_pipe || n == 0) {
-      return;
-    }
-    if (*peer_events & EPOLLIN) {
-      if (*peer_events & EPOLLRDHUP) {
-        //std::cout << "shutting down write " << fd << std::endl;
-        if(shutdown(fd, SHUT_WR) < 0) {
-          perror(nullptr);
-          std::cerr << "failed to shutdown write " << fd << std::endl;
-          handlers.erase(conn->client);
-          handlers.erase(conn->server);
-          connections.remove(fd);
+// moves bytes of one direction as far as the cached readiness of both ends
+// allows, buffering up to the pipe capacity while the destination is blocked.
+// once the source reached end of stream and the pipe is drained, the write
+// side of the destination is shut down.
+static int pump(channel &ch, int src, int dst, uint32_t &src_events, uint32_t &dst_events, worker_metrics::direction &stats, buffer_slab &buffers) {
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    ch.pick_relay(buffers);
+    if (ch.bytes_in_pipe && dst_events & EPOLLOUT) {
+      ssize_t before = ch.bytes_in_pipe;
+      int r = ch.write(dst);
+      stats.writes.add(1);
+      stats.bytes.add(before - ch.bytes_in_pipe);
+      if (r < 0) {
+        // a fast open SYN went out without the data, wait for the handshake
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINPROGRESS) {
+          return -1;
         }
-        return;
+        dst_events &= ~EPOLLOUT;
       }
-      n = conn->read(peer, get_buffer_size(number_of_connections->load()));
+      //std::cout << "write " << before - ch.bytes_in_pipe << " to " << dst << std::endl;
+      progress = ch.bytes_in_pipe != before;
+    }
+    if (!ch.eof && src_events & EPOLLIN && ch.has_room()) {
+      int n = ch.read(src);
+      stats.reads.add(1);
       if (n < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          *peer_events ^= EPOLLIN;
-        }
-        else {
-          perror(nullptr);
-          std::cerr << "failed to splice server: " << conn->server << " client: " << conn->client << " fd: " << fd << std::endl;
-          handlers.erase(conn->client);
-          handlers.erase(conn->server);
-          connections.remove(fd);
-          return;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          return -1;
         }
+        stats.eagain.add(1);
+        src_events &= ~EPOLLIN;
       }
-      //std::cout << "read " << n << " from " << peer << std::endl;
-      if (n == 0 || *peer_events & EPOLLRDHUP) {
-        //std::cout << "shutting down write " << fd << std::endl;
-        if(shutdown(fd, SHUT_WR) < 0) {
-          perror(nullptr);
-          std::cerr << "failed to shutdown write " << fd << std::endl;
-          handlers.erase(conn->client);
-          handlers.erase(conn->server);
-          connections.remove(fd);
-        }
-        *peer_events ^= ((*peer_events & EPOLLRDHUP) | EPOLLIN);
+      else {
+        //std::cout << "read " << n << " from " << src << std::endl;
+        ch.eof = n == 0;
+        progress = true;
       }
-      conn->des = fd;
     }
   }
+  if (ch.eof && !ch.bytes_in_pipe && !ch.shut && dst_events & EPOLLOUT) {
+    //std::cout << "shutting down write " << dst << std::endl;
+    if (shutdown(dst, SHUT_WR) < 0 && errno != ENOTCONN) {
+      return -1;
+    }
+    ch.shut = true;
+  }
+  return 0;
 }
 
-static void read_from(std::unordered_map<int, std::function<void(const epoll_event&)>> &handlers, connections_manager &connections, std::atomic_int *number_of_connections, connection *conn, int fd, int peer, uint32_t *fd_events, uint32_t *peer_events) {
-  while (*fd_events & EPOLLIN && conn->bytes_in_pipe == 0) {
-    if (*fd_events & EPOLLRDHUP) {
-      //std::cout << "shutting down write " << peer << std::endl;
-      if (shutdown(peer, SHUT_WR) < 0) {
-        perror(nullptr);
-        std::cerr << "failed to shutdown write " << peer << std::endl;
-        handlers.erase(conn->client);
-        handlers.erase(conn->server);
-        connections.remove(fd);
-        (*number_of_connections)--;
-        return;
-      }
-      *fd_events ^= ((*fd_events & EPOLLRDHUP) | EPOLLIN);
+void worker::accept_connections(int listen_socket) {
+  // one look at the other workers' shards per batch, the own count is exact
+  int others = counters->total() - counters->local(id);
+  while (others + counters->local(id) < max_connections) {
+    const backend_snapshot &snapshot = *backends->get();
+    if (snapshot.valid.empty()) {
+      std::cerr << "no server available" << std::endl;
       return;
     }
-    int n = conn->read(fd, get_buffer_size(number_of_connections->load()));
-    if (n < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        *fd_events ^= EPOLLIN;
-      }
-      else {
-        perror(nullptr);
-        std::cerr << "failed to splice server: " << conn->server << " client: " << conn->client << " fd: " << fd << std::endl;
-        handlers.erase(conn->client);
-        handlers.erase(conn->server);
-        connections.remove(fd);
-        (*number_of_connections)--;
-        return;
-      }
+    sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+    int client = accept4(listen_socket, reinterpret_cast<sockaddr*>(&client_addr), &client_len, SOCK_NONBLOCK);
+    //std::cout << "accepted " << client << std::endl;
+    if (client < 0) {
+      has_connections = false;
+      break;
     }
-    //std::cout << "read " << n << " from " << fd << std::endl;
-    if (n == 0 || *fd_events & EPOLLRDHUP) {
-      //std::cout << "shutting down write " << peer << std::endl;
-      if (shutdown(peer, SHUT_WR) < 0) {
-        perror(nullptr);
-        std::cerr << "failed to shutdown write " << peer << std::endl;
-        handlers.erase(conn->client);
-        handlers.erase(conn->server);
-        connections.remove(fd);
-        (*number_of_connections)--;
-        return;
-      }
-      *fd_events ^= ((*fd_events & EPOLLRDHUP) | EPOLLIN);
-      return;
+    stats->accepts.add(1);
+    const backend *server = balance.get_server(snapshot, client_addr);
+    if (!server) {
+      std::cerr << "no server available" << std::endl;
+      close(client);
+      continue;
     }
-    conn->des = peer;
-    if (*peer_events & EPOLLOUT && conn->bytes_in_pipe) {
-      n = conn->write(peer);
-      if (n < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          *peer_events ^= EPOLLIN;
+    
+    on_client_connect(client, *server);
+    //std::cout << "done on client" << std::endl;
+  }
+}
+
+void worker::set_mode(worker_mode next) {
+  mode.store(next, std::memory_order_release);
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0) {
+    perror(nullptr);
+    std::cerr << "failed to wake worker " << id << std::endl;
+  }
+}
+
+// false once the worker is to return. a draining worker leaves the listen
+// socket to the process it was handed to, a serving one finds it registered
+// by the control thread or arms its accept in the next round.
+bool worker::handle_wake(int listen_socket) {
+  uint64_t count;
+  while (read(wake_fd, &count, sizeof(count)) > 0) {
+  }
+  worker_mode current = mode.load(std::memory_order_acquire);
+  if (current == worker_mode::draining || current == worker_mode::stopping) {
+    if (!ring) {
+      epoll_del(epoll_fd, listen_socket);
+      has_connections = false;
+    }
+    else if (accepting == accept_state::armed) {
+      uring_cancel_accept(listen_socket);
+    }
+  }
+  return current != worker_mode::stopping;
+}
+
+void worker::run(int listen_socket) {
+  if (ring) {
+    run_uring(listen_socket);
+    return;
+  }
+  epoll_event events[MAX_EVENTS];
+  while (true) {
+    backends->quiescent(id);
+    if (has_connections) {
+      accept_connections(listen_socket);
+    }
+    backends->offline(id);
+    // a pool needs its ticks even when no connection is active
+    int timeout = !kernel_draining.empty() ? KERNEL_DRAIN_POLL_MS : socket_pool::max_size ? socket_pool::TICK_MS : -1;
+    ssize_t n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    backends->quiescent(id);
+    if (n < 0) {
+      perror(nullptr);
+      std::cerr << "epoll_wait failed" << std::endl;
+      continue;
+    }
+    for (ssize_t i = 0; i < n; ++i) {
+      endpoint *end = static_cast<endpoint*>(events[i].data.ptr);
+      if (end->state == endpoint_state::listen) {
+        // a handoff can leave an event of the removed listen socket in the batch
+        if (mode.load(std::memory_order_relaxed) == worker_mode::serving) {
+          has_connections = true;
+          accept_connections(listen_socket);
         }
-        else {
-          perror(nullptr);
-          std::cerr << "failed to splice server: " << conn->server << " client: " << conn->client << " fd: " << fd << std::endl;
-          handlers.erase(conn->client);
-          handlers.erase(conn->server);
-          connections.remove(fd);
-          (*number_of_connections)--;
+        continue;
+      }
+      if (end->state == endpoint_state::wake) {
+        if (!handle_wake(listen_socket)) {
           return;
         }
+        continue;
+      }
+      handle_event(end, events[i].events);
+    }
+    if (!kernel_draining.empty()) {
+      std::vector<connection_handle> draining;
+      draining.swap(kernel_draining);
+      for (connection_handle h : draining) {
+        if (connection *conn = connections.get(h)) {
+          conn->cold.draining = false;
+          relay_in_kernel(conn);
+        }
       }
-      //std::cout << "write " << n << " from " << peer << std::endl;
-      /*if (n == 0) {
-        std::cerr << "write 0 to " << fd << std::endl;
-        handlers.erase(conn->client);
-        handlers.erase(conn->server);
-        connections.remove(fd);
-        (*number_of_connections)--;
-      }*/
     }
+    connections.reclaim();
+    pool.reclaim();
+    pool.maintain(*backends->get());
   }
 }
 
-void worker::handle_server_connect(const epoll_event& ev) {
-  connection *conn = connections.get(ev.data.fd);
-  if (!conn) {
-    std::cerr << "no connection for " << ev.data.fd << std::endl;
-    handlers.erase(ev.data.fd);
+void worker::close_connection(connection *conn) {
+  if (conn->cold.in_kernel) {
+    kernel_relay->leave(conn->cold.cookies);
+  }
+  balance.on_close(conn->cold.backend);
+  connections.remove(conn->client);
+  counters->add(id, -1);
+}
+
+void worker::relay(connection *conn) {
+  if (conn->cold.in_kernel) {
+    relay_in_kernel(conn);
     return;
   }
-  if (conn->server != ev.data.fd) {
-    std::cerr << "invalid connection for " << ev.data.fd << std::endl;
-    handlers.erase(ev.data.fd);
-    handlers.erase(conn->server);
-    handlers.erase(conn->client);
-    connections.remove(ev.data.fd);
-    (*number_of_connections)--;
+  if (pump(conn->upstream, conn->client, conn->server, conn->client_event, conn->server_event, stats->upstream, connections.buffers()) < 0) {
+    perror(nullptr);
+    std::cerr << "failed to relay client " << conn->client << " to server " << conn->server << std::endl;
+    close_connection(conn);
+    return;
   }
-  if (ev.events & EPOLLERR || ev.events & EPOLLHUP || ev.events & EPOLLPRI) {
+  if (conn->server_connected && pump(conn->downstream, conn->server, conn->client, conn->server_event, conn->client_event, stats->downstream, connections.buffers()) < 0) {
     perror(nullptr);
-    std::cerr << "failed to connect server socket" << std::endl;
-    handlers.erase(ev.data.fd);
-    handlers.erase(conn->client);
-    connections.remove(ev.data.fd);
-    (*number_of_connections)--;
+    std::cerr << "failed to relay server " << conn->server << " to client " << conn->client << std::endl;
+    close_connection(conn);
+    return;
+  }
+  if (conn->finished()) {
+    //std::cout << conn->server << " and " << conn->client << " finished" << std::endl;
+    close_connection(conn);
+    return;
+  }
+  if (kernel_relay && conn->server_connected) {
+    join_kernel(conn);
+  }
+  arm_timer(conn);
+}
+
+// hands the connection over to the kernel once nothing is buffered on either
+// side and both sockets were read dry
+void worker::join_kernel(connection *conn) {
+  connection::cold_fields &cold = conn->cold;
+  if (cold.join_attempts >= MAX_JOIN_ATTEMPTS || conn->upstream.bytes_in_pipe || conn->downstream.bytes_in_pipe
+      || conn->upstream.eof || conn->downstream.eof || conn->client_event & EPOLLIN || conn->server_event & EPOLLIN) {
     return;
   }
+  ++cold.join_attempts;
+  int fds[2] = {conn->client, conn->server};
+  for (int k = 0; k < 2; ++k) {
+    cold.received_base[k] = sockmap_relay::consumed(fds[k]);
+    cold.queued_base[k] = sockmap_relay::queued(fds[k]);
+  }
+  cold.in_kernel = kernel_relay->join(conn->client, conn->server, cold.cookies) == 0;
+  if (cold.in_kernel) {
+    conn->upstream.release_buffer(connections.buffers());
+    conn->downstream.release_buffer(connections.buffers());
+  }
+}
 
-  int err = 0;
-  socklen_t err_len = sizeof(err);
-  getsockopt(ev.data.fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
-  if (err) {
-    if (err == EINPROGRESS) {
-      //std::cout << "server connection in progress for " << conn->client << std::endl;
+// the kernel moves the bytes, only ends of stream are passed on here. a
+// shutdown must not overtake bytes still on their way to the other socket,
+// so it waits until the destination queued everything the source received.
+void worker::relay_in_kernel(connection *conn) {
+  int fds[2] = {conn->client, conn->server};
+  uint32_t events[2] = {conn->client_event, conn->server_event};
+  channel *channels[2] = {&conn->upstream, &conn->downstream};
+  bool waiting = false;
+  for (int k = 0; k < 2; ++k) {
+    channel &ch = *channels[k];
+    int src = fds[k];
+    int dst = fds[1 - k];
+    if (!ch.eof && events[k] & (EPOLLRDHUP | EPOLLHUP)) {
+      ch.eof = true;
+    }
+    if (!ch.eof || ch.shut) {
+      continue;
+    }
+    // the received count includes the sequence number taken by the FIN
+    if (sockmap_relay::queued(dst) - conn->cold.queued_base[1 - k] < sockmap_relay::received(src) - conn->cold.received_base[k] - 1) {
+      waiting = true;
+      continue;
+    }
+    if (shutdown(dst, SHUT_WR) < 0 && errno != ENOTCONN) {
+      perror(nullptr);
+      std::cerr << "failed to shut down " << dst << " after the kernel relay" << std::endl;
+      close_connection(conn);
       return;
     }
-    std::cerr << "failed to connect server socket: " << std::strerror(err) << std::endl;
-    handlers.erase(ev.data.fd);
-    handlers.erase(conn->client);
-    connections.remove(ev.data.fd);
-    (*number_of_connections)--;
+    ch.shut = true;
+  }
+  if (conn->finished()) {
+    close_connection(conn);
     return;
   }
-  conn->server_event |= ev.events;
-  if (conn->bytes_in_pipe) {
-    //std::cout << "data in pipes before connecting: " << conn->bytes_in_pipe << std::endl;
-    write_to(handlers, connections, number_of_connections, conn, conn->server, conn->client, &(conn->server_event), &(conn->client_event));
+  if (waiting && !conn->cold.draining) {
+    conn->cold.draining = true;
+    kernel_draining.push_back(conn->handle());
   }
-  handlers[conn->server] = std::bind(&worker::handle_data_transfer, this, std::placeholders::_1);
-  handlers[conn->client] = std::bind(&worker::handle_data_transfer, this, std::placeholders::_1);
-  //std::cout << conn->server << " and " << conn->client << " connected" << std::endl;
+  arm_timer(conn);
 }
 
-void worker::handle_data_transfer(const epoll_event& ev) {
-  connection* conn = connections.get(ev.data.fd);
-  if (conn == nullptr) {
-    std::cerr << "no connection for fd " << ev.data.fd << std::endl;
-    handlers.erase(ev.data.fd);
-    epoll_del(epoll_fd, ev.data.fd);
-    close(ev.data.fd);
+uint64_t worker::phase_timeout_ms(const connection *conn) const {
+  if (!conn->server_connected) {
+    return connect_timeout_ms;
+  }
+  return conn->upstream.eof || conn->downstream.eof ? linger_timeout_ms : idle_timeout_ms;
+}
+
+// timeout of the phase a connection is in, in ticks. a disabled one still
+// gets the connection looked at again after the shortest enabled timeout, its
+// phase may change meanwhile. 0 when every timeout is disabled.
+uint64_t worker::timeout_ticks(const connection *conn) const {
+  uint64_t ms = phase_timeout_ms(conn);
+  if (!ms) {
+    for (uint64_t other : {connect_timeout_ms, idle_timeout_ms, linger_timeout_ms}) {
+      if (other && (!ms || other < ms)) {
+        ms = other;
+      }
+    }
+  }
+  return ms ? (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS : 0;
+}
+
+void worker::start_timer(connection *conn) {
+  if (timer_fd < 0) {
     return;
   }
-  if (ev.events & EPOLLERR || ev.events & EPOLLPRI) {
-    perror(nullptr);
-    std::cerr << "epoll error when transfer data" << std::endl;
-    handlers.erase(conn->server);
-    handlers.erase(conn->client);
-    connections.remove(ev.data.fd);
-    (*number_of_connections)--;
+  // a stopped wheel is empty, it picks up at the current tick
+  if (!timer_running && !timers.size()) {
+    timers.start(now_tick());
+  }
+  conn->last_active = timers.now();
+  arm_timer(conn);
+}
+
+// makes sure an entry expires no later than the deadline of the current
+// phase. one that is due earlier already covers it, it is rescheduled when
+// it turns out the connection is not expired yet.
+void worker::arm_timer(connection *conn) {
+  uint64_t ticks = timeout_ticks(conn);
+  if (!ticks || timer_fd < 0) {
     return;
-  } 
-  int peer = conn->get_peer(ev.data.fd);
-  if (peer < 0) {
-    std::cerr << "failed to get peer, peer does not exists" << std::endl;
-    handlers.erase(ev.data.fd);
-    handlers.erase(conn->client);
-    handlers.erase(conn->server);
-    connections.remove(ev.data.fd);
-    (*number_of_connections)--;
+  }
+  uint64_t due = (phase_timeout_ms(conn) ? conn->last_active : timers.now()) + ticks;
+  if (conn->cold.timer_due && conn->cold.timer_due <= due) {
     return;
   }
-  uint32_t *conn_event = conn->get_event(ev.data.fd);
-  uint32_t *peer_event = conn->get_event(peer);
+  conn->cold.timer_due = timers.schedule(conn->handle(), due);
+  if (!timer_running) {
+    itimerspec spec{};
+    spec.it_interval.tv_nsec = TIMER_TICK_MS * 1000000;
+    spec.it_value = spec.it_interval;
+    timer_running = timerfd_settime(timer_fd, 0, &spec, nullptr) == 0;
+  }
+}
 
-  if (ev.events & EPOLLHUP) {
-    *conn_event = EPOLLHUP;
-    if (*peer_event == EPOLLHUP) {
-      handlers.erase(ev.data.fd);
-      handlers.erase(peer);
-      connections.remove(peer);
-      (*number_of_connections)--;
+void worker::handle_timer() {
+  uint64_t expirations;
+  while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+  }
+  timers.advance(now_tick(), [this](const timer_wheel::entry &e) {
+    if (connection *conn = connections.get(e.handle)) {
+      // an entry that was superseded by an earlier one is ignored
+      if (e.expires == conn->cold.timer_due) {
+        handle_timeout(conn, e.handle);
+      }
     }
-    if ((conn->bytes_in_pipe && peer == conn->des) || !(*peer_event & EPOLLOUT)) {
-      return;
+  });
+  // nothing left to expire, the timer stops until the next connection
+  if (!timers.size()) {
+    itimerspec spec{};
+    timerfd_settime(timer_fd, 0, &spec, nullptr);
+    timer_running = false;
+  }
+}
+
+// entries are never removed, the connection is only closed when it has been
+// silent for the whole timeout of its current phase
+void worker::handle_timeout(connection *conn, connection_handle h) {
+  conn->cold.timer_due = 0;
+  if (conn->cold.in_kernel) {
+    uint64_t received = sockmap_relay::received(conn->client) + sockmap_relay::received(conn->server);
+    if (received != conn->cold.kernel_received) {
+      conn->cold.kernel_received = received;
+      conn->last_active = timers.now();
     }
-    //std::cout << "shutting down write " << peer << std::endl;
-    if (shutdown(peer, SHUT_WR) < 0) {
-      perror(nullptr);
-      std::cerr << "failed to shutdown write " << peer << std::endl;
-      handlers.erase(conn->client);
-      handlers.erase(conn->server);
-      connections.remove(peer);
-      (*number_of_connections)--;
-      return;
+  }
+  if (!phase_timeout_ms(conn) || conn->last_active + timeout_ticks(conn) > timers.now()) {
+    arm_timer(conn);
+    return;
+  }
+  if (!conn->server_connected) {
+    // a backend that does not answer is treated like one that refused
+    std::cerr << "connect of " << conn->client << " timed out" << std::endl;
+    retry_connect(conn);
+    if ((conn = connections.get(h))) {
+      start_timer(conn);
     }
-    *peer_event ^= EPOLLOUT;
     return;
   }
-  *conn_event |= ev.events;
-  read_from(handlers, connections, number_of_connections, conn, ev.data.fd, peer, conn_event, peer_event);
+  std::cerr << "connection of " << conn->client << " timed out" << std::endl;
+  stats->timeouts.add(1);
+  close_connection(conn);
+}
 
-  write_to(handlers, connections, number_of_connections, conn, ev.data.fd, peer, conn_event, peer_event);
+void worker::handle_event(endpoint *end, uint32_t events) {
+  switch (end->state) {
+  case endpoint_state::preread_client:
+    handle_preread_client(end->conn, events);
+    break;
+  case endpoint_state::connecting_server:
+    handle_server_connect(end->conn, events);
+    break;
+  case endpoint_state::transfer:
+    handle_data_transfer(end->conn, end, events);
+    break;
+  case endpoint_state::pool_connecting:
+  case endpoint_state::pool_idle:
+    pool.handle_event(static_cast<pooled_socket*>(end), events);
+    break;
+  case endpoint_state::timer:
+    handle_timer();
+    break;
+  case endpoint_state::closed:
+    // closed earlier in the same batch of events
+    break;
+  default:
+    std::cerr << "unexpected endpoint state " << (int) end->state << std::endl;
+    break;
+  }
 }
 
-void worker::handle_preread_client(const epoll_event &ev) {
-  connection *conn = connections.get(ev.data.fd);
-  if (!conn) {
-    std::cerr << "no connection for fd " << ev.data.fd << std::endl;
-    handlers.erase(ev.data.fd);
-    close(ev.data.fd);
-    epoll_del(epoll_fd, ev.data.fd);
-    return;   
-  }
-  if (ev.events & EPOLLERR || ev.events & EPOLLHUP || ev.events & EPOLLPRI) {
-    perror(nullptr);
-    std::cerr << "epoll error when transfer data" << std::endl;
-    handlers.erase(conn->server);
-    handlers.erase(conn->client);
-    connections.remove(ev.data.fd);
-    (*number_of_connections)--;
+void worker::handle_server_connect(connection *conn, uint32_t events) {
+  int err = 0;
+  socklen_t err_len = sizeof(err);
+  getsockopt(conn->server, SOL_SOCKET, SO_ERROR, &err, &err_len);
+  if (err == EINPROGRESS && !(events & (EPOLLERR | EPOLLHUP | EPOLLPRI))) {
+    //std::cout << "server connection in progress for " << conn->client << std::endl;
     return;
   }
-  conn->client_event |= ev.events;
-  if (conn->bytes_in_pipe) {
+  if (err || events & (EPOLLERR | EPOLLHUP | EPOLLPRI)) {
+    std::cerr << "failed to connect server socket: " << std::strerror(err) << std::endl;
+    if (conn->cold.sent_in_syn) {
+      // only records the failure, the client bytes are gone with the socket
+      conn->cold.connect_attempts = MAX_CONNECT_ATTEMPTS;
+    }
+    retry_connect(conn);
     return;
   }
+  balance.on_connected(conn->cold.backend, monotonic_us() - conn->cold.connect_started);
+  conn->server_connected = true;
+  conn->server_event |= events;
+  conn->last_active = timers.now();
+  conn->server_end.state = endpoint_state::transfer;
+  conn->client_end.state = endpoint_state::transfer;
+  //std::cout << conn->server << " and " << conn->client << " connected" << std::endl;
+  relay(conn);
+}
 
-  if (conn->client_event & EPOLLIN) {
-    int n = conn->read(ev.data.fd, get_buffer_size(number_of_connections->load()));
-    if (n < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        conn->client_event ^= EPOLLIN;
-      }
-      else {
-        perror(nullptr);
-        std::cerr << "failed to splice server: " << conn->server << " client: " << conn->client << " fd: " << ev.data.fd << std::endl;
-        handlers.erase(conn->client);
-        handlers.erase(conn->server);
-        connections.remove(ev.data.fd);
-        (*number_of_connections)--;
-        return;
-      }
+// moves a connection whose backend failed the connect to another one. what
+// the client sent meanwhile waits in the upstream pipe and goes to the new
+// backend.
+void worker::retry_connect(connection *conn) {
+  balance.on_failed(conn->cold.backend);
+  while (conn->cold.connect_attempts < MAX_CONNECT_ATTEMPTS) {
+    ++conn->cold.connect_attempts;
+    sockaddr_in client_addr{};
+    socklen_t client_len = sizeof(client_addr);
+    if (balancer::mode == strategy::maglev) {
+      getpeername(conn->client, reinterpret_cast<sockaddr*>(&client_addr), &client_len);
+    }
+    const backend *server = balance.get_server(*backends->get(), client_addr, conn->cold.backend);
+    int fd = server ? backend_socket() : -1;
+    if (fd < 0) {
+      break;
+    }
+    connections.replace_server(*conn, fd);
+    balance.on_close(conn->cold.backend);
+    balance.on_open(server->id);
+    conn->cold.backend = server->id;
+    conn->server_event = 0;
+    conn->cold.connect_started = monotonic_us();
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&server->address), sizeof(server->address)) < 0 && errno != EINPROGRESS) {
+      balance.on_failed(server->id);
+      continue;
     }
-    //std::cout << "read " << n << " from " << ev.data.fd << std::endl;
-    conn->des = conn->server;
+    if (epoll_add(epoll_fd, fd, EPOLLOUT | EPOLLRDHUP | EPOLLIN | EPOLLET | EPOLLPRI, &conn->server_end) < 0) {
+      break;
+    }
+    // every backend gets the whole connect timeout
+    conn->last_active = timers.now();
+    return;
   }
+  std::cerr << "no backend accepted the connection of " << conn->client << std::endl;
+  close_connection(conn);
 }
 
-void worker::on_client_connect(int client_fd, const sockaddr_in &addr) {
-  connection conn;
-  if (pipe2(conn.pipes, O_DIRECT | O_NONBLOCK) < 0) {
+void worker::handle_data_transfer(connection *conn, endpoint *end, uint32_t events) {
+  if (events & EPOLLERR || events & EPOLLPRI) {
     perror(nullptr);
-    std::cerr << "failed to create pipe" << std::endl;
-    close(client_fd);
+    std::cerr << "epoll error when transfer data" << std::endl;
+    close_connection(conn);
+    return;
+  } 
+  // a hang up is reported once; let the next read observe the end of stream
+  *conn->get_event(end) |= events & EPOLLHUP ? events | EPOLLIN : events;
+  conn->last_active = timers.now();
+  relay(conn);
+}
+
+void worker::handle_preread_client(connection *conn, uint32_t events) {
+  if (events & EPOLLERR || events & EPOLLHUP || events & EPOLLPRI) {
+    perror(nullptr);
+    std::cerr << "epoll error when transfer data" << std::endl;
+    close_connection(conn);
     return;
   }
-  conn.client = client_fd;
-  conn.server = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-  conn.bytes_in_pipe = 0;
-  conn.client_event = 0;
-  conn.server_event = 0;
-  if (conn.server < 0) {
+  conn->client_event |= events;
+  relay(conn);
+}
+
+void worker::on_client_connect(int client_fd, const backend &server) {
+  const sockaddr_in &addr = server.address;
+  uint64_t pooled_latency = 0;
+  int pooled = pool.take(server.id, pooled_latency);
+  connection conn;
+  if (conn.open(client_fd, pooled) < 0) {
     perror(nullptr);
-    std::cerr << "failed to create server socket" << std::endl;
+    std::cerr << "failed to create pipes or server socket for " << client_fd << std::endl;
     conn.clean_up(epoll_fd);
+    return;
+  }
+  bool fastopen = false;
+  if (pooled < 0 && fastopen_connect) {
+    // whatever the client sent already rides in the backend SYN, the connect
+    // below then returns at once and the first write sends the SYN
+    int n = conn.upstream.read(client_fd);
+    const int opt = 1;
+    fastopen = n > 0 && setsockopt(conn.server, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &opt, sizeof(opt)) == 0;
+    if (n > 0 && !fastopen) {
+      perror(nullptr);
+      std::cerr << "failed to enable fast open for " << client_fd << std::endl;
+    }
+    conn.upstream.eof = n == 0;
   }
-  if (connect(conn.server, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0) {
-    if (errno != EINPROGRESS) {
+  conn.cold.connect_started = monotonic_us();
+  if (pooled < 0) {
+    int r = connect(conn.server, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr));
+    if (r == 0 && fastopen) {
+      // the first write sends the SYN. the socket is only writable again
+      // once the handshake is done, so its result still goes through
+      // handle_server_connect like any other connect
+      ssize_t queued = conn.upstream.bytes_in_pipe;
+      int w = conn.upstream.write(conn.server);
+      conn.cold.sent_in_syn = conn.upstream.bytes_in_pipe < queued;
+      r = -1;
+      if (w >= 0 || errno == EAGAIN) {
+        errno = EINPROGRESS;
+      }
+    }
+    if (r < 0 && errno != EINPROGRESS) {
       perror(nullptr);
       std::cerr << "failed to connect server socket for " << client_fd << std::endl;
+      balance.on_failed(server.id);
       conn.clean_up(epoll_fd);
       return;
     }
-
-    handlers[conn.server] = std::bind(&worker::handle_server_connect, this, std::placeholders::_1);
-    handlers[client_fd] = std::bind(&worker::handle_preread_client, this, std::placeholders::_1);
+    conn.server_end.state = endpoint_state::connecting_server;
+    conn.client_end.state = endpoint_state::preread_client;
   }
   else {
-    handlers[conn.server] = std::bind(&worker::handle_data_transfer, this, std::placeholders::_1);
-    handlers[conn.client] = std::bind(&worker::handle_data_transfer, this, std::placeholders::_1);
+    balance.on_connected(server.id, pooled_latency);
+    conn.server_connected = true;
+    conn.server_end.state = endpoint_state::transfer;
+    conn.client_end.state = endpoint_state::transfer;
   }
-  connections.add(conn);
-  (*number_of_connections)++;
-  if (epoll_add(epoll_fd, conn.server, EPOLLOUT | EPOLLRDHUP | EPOLLIN | EPOLLET | EPOLLPRI) < 0 || epoll_add(epoll_fd, client_fd, EPOLLOUT | EPOLLRDHUP | EPOLLIN | EPOLLET | EPOLLPRI) < 0) {
+  conn.cold.backend = server.id;
+  connection *added = connections.add(conn);
+  counters->add(id, 1);
+  balance.on_open(server.id);
+  if (epoll_add(epoll_fd, added->server, EPOLLOUT | EPOLLRDHUP | EPOLLIN | EPOLLET | EPOLLPRI, &added->server_end) < 0 || epoll_add(epoll_fd, client_fd, EPOLLOUT | EPOLLRDHUP | EPOLLIN | EPOLLET | EPOLLPRI, &added->client_end) < 0) {
     perror(nullptr);
     std::cerr << "failed to add client and server to epoll" << std::endl;
-    connections.remove(client_fd);
-    (*number_of_connections)--;
-    handlers.erase(conn.client);
-    handlers.erase(conn.server);
+    close_connection(added);
+    return;
   }
+  start_timer(added);
 }
-
-bool valid_timestamp(uint64_t timestamp) {
-  return timestamp > (uint64_t) std::chrono::duration_cast<std::chrono::seconds>((std::chrono::system_clock::now() - std::chrono::seconds(5)).time_since_epoch()).count();
-}
-
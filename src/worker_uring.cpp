@@ -0,0 +1,393 @@
+#include "../headers/worker.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// set on the poll that guards a splice. a failed poll cancels its linked
+// splice without a completion, so the poll's own completion ends the chain.
+static constexpr uint8_t URING_POLLED = 0x80;
+
+// user data of requests that belong to a connection carry its handle, so a
+// completion reaped after the slot was reused is recognised as stale:
+// generation in the upper 32 bits, slot index in the next 24, op in the low 8.
+static constexpr uint64_t user_data(connection_handle h, uint8_t op) {
+  return (static_cast<uint64_t>(h.generation) << 32) | (static_cast<uint64_t>(h.index & 0xffffff) << 8) | op;
+}
+
+static constexpr uint64_t user_data(int fd, uint8_t op) {
+  return (static_cast<uint64_t>(fd) << 8) | op;
+}
+
+static void prep_splice(io_uring_sqe *sqe, int fd_in, int fd_out, size_t len, uint64_t data) {
+  sqe->opcode = IORING_OP_SPLICE;
+  sqe->fd = fd_out;
+  sqe->off = -1;
+  sqe->splice_off_in = -1;
+  sqe->splice_fd_in = fd_in;
+  sqe->len = len;
+  sqe->splice_flags = SPLICE_F_NONBLOCK;
+  sqe->user_data = data;
+}
+
+static void prep_poll(io_uring_sqe *sqe, int fd, uint32_t events, uint64_t data) {
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = events;
+  sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+  sqe->user_data = data;
+}
+
+void worker::uring_handle_accept(int listen_socket, const io_uring_cqe &cqe) {
+  if (!(cqe.flags & IORING_CQE_F_MORE)) {
+    accepting = accept_state::idle;
+  }
+  if (cqe.res < 0) {
+    if (cqe.res != -ECANCELED) {
+      std::cerr << "failed to accept: " << std::strerror(-cqe.res) << std::endl;
+    }
+    return;
+  }
+  stats->accepts.add(1);
+  if (counters->total() >= max_connections - 1 && accepting == accept_state::armed) {
+    uring_cancel_accept(listen_socket);
+  }
+  // multishot accept shares one address buffer between completions, ask the
+  // socket itself when the strategy needs it
+  sockaddr_in client_addr{};
+  socklen_t client_len = sizeof(client_addr);
+  if (balancer::mode == strategy::maglev) {
+    getpeername(cqe.res, reinterpret_cast<sockaddr*>(&client_addr), &client_len);
+  }
+  const backend *server = balance.get_server(*backends->get(), client_addr);
+  if (!server) {
+    std::cerr << "no server available" << std::endl;
+    close(cqe.res);
+    return;
+  }
+  uring_on_client_connect(cqe.res, *server);
+}
+
+void worker::run_uring(int listen_socket) {
+  uring_wait_wake();
+  bool running = true;
+  while (running) {
+    if (accepting == accept_state::idle && counters->total() < max_connections && mode.load(std::memory_order_relaxed) == worker_mode::serving) {
+      uring_accept(listen_socket);
+    }
+    backends->offline(id);
+    int r = ring->submit_and_wait(1);
+    backends->quiescent(id);
+    if (r < 0 && errno != EBUSY) {
+      perror(nullptr);
+      std::cerr << "io_uring_enter failed" << std::endl;
+      continue;
+    }
+    ring->for_each_cqe([&](const io_uring_cqe &cqe) {
+      if ((cqe.user_data & 0xff) == URING_ACCEPT) {
+        uring_handle_accept(listen_socket, cqe);
+      }
+      else if ((cqe.user_data & 0xff) == URING_WAKE) {
+        // the rest of the batch is still handled before returning
+        running = running && handle_wake(listen_socket);
+        uring_wait_wake();
+      }
+      else {
+        uring_handle_completion(cqe);
+      }
+    });
+  }
+}
+
+int worker::init_uring() {
+  ring = std::make_unique<uring>();
+  if (ring->init(URING_ENTRIES) < 0) {
+    ring.reset();
+    return -1;
+  }
+  return 0;
+}
+
+void worker::uring_accept(int listen_socket) {
+  io_uring_sqe *sqe = ring->get_sqe();
+  if (!sqe) {
+    perror(nullptr);
+    std::cerr << "failed to queue accept" << std::endl;
+    return;
+  }
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listen_socket;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK;
+  sqe->user_data = user_data(listen_socket, URING_ACCEPT);
+  accepting = accept_state::armed;
+}
+
+// a one shot poll, handle_wake reads the eventfd and the poll is queued again
+void worker::uring_wait_wake() {
+  io_uring_sqe *sqe = ring->get_sqe();
+  if (!sqe) {
+    perror(nullptr);
+    std::cerr << "failed to queue the wake up poll of worker " << id << std::endl;
+    return;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = wake_fd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = user_data(wake_fd, URING_WAKE);
+}
+
+void worker::uring_cancel_accept(int listen_socket) {
+  io_uring_sqe *sqe = ring->get_sqe();
+  if (!sqe) {
+    perror(nullptr);
+    std::cerr << "failed to queue accept cancellation" << std::endl;
+    return;
+  }
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = user_data(listen_socket, URING_ACCEPT);
+  sqe->user_data = user_data(listen_socket, URING_ACCEPT_CANCEL);
+  accepting = accept_state::canceling;
+}
+
+void worker::uring_on_client_connect(int client_fd, const backend &server) {
+  connection conn;
+  if (conn.open(client_fd, -1) < 0) {
+    perror(nullptr);
+    std::cerr << "failed to create pipes or server socket for " << client_fd << std::endl;
+    conn.clean_up(epoll_fd);
+    return;
+  }
+  conn.cold.backend = server.id;
+  connection *c = connections.add(conn);
+  counters->add(id, 1);
+  balance.on_open(server.id);
+
+  if (uring_connect(c, server) < 0) {
+    // nothing is in flight yet, so no completion would release it
+    c->closing = true;
+    uring_release(c);
+    return;
+  }
+  uring_advance(c, c->upstream, c->client, c->server, false, URING_UPSTREAM_READ, URING_UPSTREAM_WRITE);
+}
+
+int worker::uring_connect(connection *conn, const backend &server) {
+  io_uring_sqe *sqe = ring->get_sqe();
+  if (!sqe) {
+    perror(nullptr);
+    std::cerr << "failed to queue connect for " << conn->client << std::endl;
+    return -1;
+  }
+  // the slot outlives the request, its pending count keeps it from reuse
+  conn->cold.connect_address = server.address;
+  conn->cold.connect_started = monotonic_us();
+  sqe->opcode = IORING_OP_CONNECT;
+  sqe->fd = conn->server;
+  sqe->addr = reinterpret_cast<uint64_t>(&conn->cold.connect_address);
+  sqe->off = sizeof(conn->cold.connect_address);
+  sqe->user_data = user_data(conn->handle(), URING_CONNECT);
+  ++conn->pending;
+  return 0;
+}
+
+// retry_connect for io_uring workers. nothing is in flight on the failed
+// server socket, writes to it wait for the connect, so it is swapped at once.
+// what the client sent meanwhile waits in the upstream pipe.
+void worker::uring_retry_connect(connection *conn) {
+  balance.on_failed(conn->cold.backend);
+  while (conn->cold.connect_attempts < MAX_CONNECT_ATTEMPTS) {
+    ++conn->cold.connect_attempts;
+    sockaddr_in client_addr{};
+    socklen_t client_len = sizeof(client_addr);
+    if (balancer::mode == strategy::maglev) {
+      getpeername(conn->client, reinterpret_cast<sockaddr*>(&client_addr), &client_len);
+    }
+    const backend *server = balance.get_server(*backends->get(), client_addr, conn->cold.backend);
+    int fd = server ? backend_socket() : -1;
+    if (fd < 0) {
+      break;
+    }
+    connections.replace_server(*conn, fd);
+    balance.on_close(conn->cold.backend);
+    balance.on_open(server->id);
+    conn->cold.backend = server->id;
+    if (uring_connect(conn, *server) == 0) {
+      return;
+    }
+  }
+  std::cerr << "no backend accepted the connection of " << conn->client << std::endl;
+  uring_close_connection(conn);
+}
+
+// submits the next step of one direction unless one is already in flight:
+// drain the pipe into the destination, shut it down after end of stream, or
+// wait for the source to become readable and splice it into the pipe.
+void worker::uring_advance(connection *conn, channel &ch, int src, int dst, bool dst_ready, uring_op read_op, uring_op write_op) {
+  if (ch.in_flight || ch.shut) {
+    return;
+  }
+  if (ch.bytes_in_pipe || ch.eof) {
+    if (!dst_ready) {
+      return;
+    }
+    if (!ch.bytes_in_pipe) {
+      if (shutdown(dst, SHUT_WR) < 0 && errno != ENOTCONN) {
+        perror(nullptr);
+        std::cerr << "failed to shutdown write " << dst << std::endl;
+        uring_close_connection(conn);
+        return;
+      }
+      ch.shut = true;
+      return;
+    }
+  }
+  io_uring_sqe *poll_sqe = ring->get_sqe();
+  io_uring_sqe *splice_sqe = poll_sqe ? ring->get_sqe() : nullptr;
+  if (!splice_sqe) {
+    perror(nullptr);
+    std::cerr << "failed to queue splice for " << conn->client << std::endl;
+    if (poll_sqe) {
+      poll_sqe->opcode = IORING_OP_NOP;
+      poll_sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    }
+    uring_close_connection(conn);
+    return;
+  }
+  if (ch.bytes_in_pipe) {
+    prep_poll(poll_sqe, dst, POLLOUT, user_data(conn->handle(), write_op | URING_POLLED));
+    prep_splice(splice_sqe, ch.pipes[0], dst, ch.bytes_in_pipe, user_data(conn->handle(), write_op));
+  }
+  else {
+    prep_poll(poll_sqe, src, POLLIN | POLLRDHUP, user_data(conn->handle(), read_op | URING_POLLED));
+    prep_splice(splice_sqe, src, ch.pipes[1], ch.read_size(), user_data(conn->handle(), read_op));
+  }
+  ch.in_flight = true;
+  ++conn->pending;
+}
+
+void worker::uring_handle_completion(const io_uring_cqe &cqe) {
+  uring_op op = static_cast<uring_op>(cqe.user_data & 0xff & ~URING_POLLED);
+  if (op == URING_CLOSE || op == URING_ACCEPT_CANCEL) {
+    if (cqe.res < 0 && cqe.res != -ECANCELED && cqe.res != -ENOENT) {
+      std::cerr << "io_uring operation " << (int) op << " failed for " << (cqe.user_data >> 8) << ": " << std::strerror(-cqe.res) << std::endl;
+    }
+    return;
+  }
+  connection_handle h{static_cast<uint32_t>((cqe.user_data >> 8) & 0xffffff), static_cast<uint32_t>(cqe.user_data >> 32)};
+  connection *conn = connections.get(h);
+  if (!conn) {
+    std::cerr << "stale completion for connection slot " << h.index << std::endl;
+    return;
+  }
+  --conn->pending;
+  int res = cqe.res;
+  switch (op) {
+  case URING_CONNECT:
+    if (res < 0 && !conn->closing) {
+      std::cerr << "failed to connect server socket: " << std::strerror(-res) << std::endl;
+      uring_retry_connect(conn);
+    }
+    else if (res >= 0) {
+      balance.on_connected(conn->cold.backend, monotonic_us() - conn->cold.connect_started);
+    }
+    conn->server_connected = res >= 0;
+    break;
+  case URING_UPSTREAM_READ:
+  case URING_DOWNSTREAM_READ: {
+    channel &ch = op == URING_UPSTREAM_READ ? conn->upstream : conn->downstream;
+    worker_metrics::direction &direction = op == URING_UPSTREAM_READ ? stats->upstream : stats->downstream;
+    ch.in_flight = false;
+    direction.reads.add(1);
+    direction.eagain.add(res == -EAGAIN);
+    if (res >= 0) {
+      ch.on_read(res);
+      ch.eof = res == 0;
+    }
+    else if (res != -EAGAIN && !conn->closing) {
+      std::cerr << "failed to splice server: " << conn->server << " client: " << conn->client << ": " << std::strerror(-res) << std::endl;
+      uring_close_connection(conn);
+    }
+    break;
+  }
+  case URING_UPSTREAM_WRITE:
+  case URING_DOWNSTREAM_WRITE: {
+    channel &ch = op == URING_UPSTREAM_WRITE ? conn->upstream : conn->downstream;
+    worker_metrics::direction &direction = op == URING_UPSTREAM_WRITE ? stats->upstream : stats->downstream;
+    ch.in_flight = false;
+    direction.writes.add(1);
+    if (res >= 0) {
+      ch.bytes_in_pipe -= res;
+      direction.bytes.add(res);
+    }
+    else if (res != -EAGAIN && !conn->closing) {
+      std::cerr << "failed to splice server: " << conn->server << " client: " << conn->client << ": " << std::strerror(-res) << std::endl;
+      uring_close_connection(conn);
+    }
+    break;
+  }
+  default:
+    break;
+  }
+  if (!conn->closing) {
+    uring_advance(conn, conn->upstream, conn->client, conn->server, conn->server_connected, URING_UPSTREAM_READ, URING_UPSTREAM_WRITE);
+  }
+  if (!conn->closing && conn->server_connected) {
+    uring_advance(conn, conn->downstream, conn->server, conn->client, true, URING_DOWNSTREAM_READ, URING_DOWNSTREAM_WRITE);
+  }
+  if (!conn->closing && conn->finished()) {
+    uring_close_connection(conn);
+  }
+  if (conn->closing && !conn->pending) {
+    uring_release(conn);
+  }
+}
+
+// cancels whatever is still in flight on both sockets. only the completion
+// handler releases the connection, once the last of its completions has been
+// reaped, so it is never released twice.
+void worker::uring_close_connection(connection *conn) {
+  if (conn->closing) {
+    return;
+  }
+  conn->closing = true;
+  if (!conn->pending) {
+    return;
+  }
+  for (int fd : {conn->client, conn->server}) {
+    io_uring_sqe *sqe = ring->get_sqe();
+    if (!sqe) {
+      perror(nullptr);
+      std::cerr << "failed to queue cancellation for " << fd << std::endl;
+      continue;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = user_data(conn->handle(), URING_CANCEL);
+    ++conn->pending;
+  }
+}
+
+void worker::uring_release(connection *conn) {
+  int fds[] = {conn->client, conn->server, conn->upstream.pipes[0], conn->upstream.pipes[1], conn->downstream.pipes[0], conn->downstream.pipes[1]};
+  balance.on_close(conn->cold.backend);
+  connections.detach(conn->client);
+  counters->add(id, -1);
+  for (int fd : fds) {
+    io_uring_sqe *sqe = ring->get_sqe();
+    if (!sqe) {
+      close(fd);
+      continue;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->user_data = user_data(fd, URING_CLOSE);
+  }
+}